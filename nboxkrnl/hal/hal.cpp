@@ -36,6 +36,14 @@ VOID HalInitSystem()
 	KiIdt[IDT_INT_VECTOR_BASE + 11] = ((uint64_t)0x8 << 16) | ((uint64_t)&HalpSmbusIsr & 0x0000FFFF) | (((uint64_t)&HalpSmbusIsr & 0xFFFF0000) << 32) | ((uint64_t)0x8E00 << 32);
 	HalEnableSystemInterrupt(11, LevelSensitive);
 
+	// Connect the IDE interrupt, used by the host to signal the completion of I/O requests. If the host doesn't support it, we keep polling instead
+	KeInitializeDpc(&HalpIdeDpcObject, HalpIdeDpcRoutine, nullptr);
+	KiIdt[IDT_INT_VECTOR_BASE + 14] = ((uint64_t)0x8 << 16) | ((uint64_t)&HalpIdeIsr & 0x0000FFFF) | (((uint64_t)&HalpIdeIsr & 0xFFFF0000) << 32) | ((uint64_t)0x8E00 << 32);
+	HalEnableSystemInterrupt(14, Edge);
+	outl(IO_INTERRUPT_ENABLE, 1);
+	IoInterruptEnabled = inl(IO_INTERRUPT_ENABLE) == 1;
+	RegisterIoRingWithHost();
+
 	HalpInitSMCstate();
 
 	if (XboxType == SYSTEM_DEVKIT) {
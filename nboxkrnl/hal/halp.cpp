@@ -31,6 +31,7 @@ BYTE HalpSmbusData[32];
 UCHAR HalpBlockAmount;
 KEVENT HalpSmbusLock;
 KEVENT HalpSmbusComplete;
+KDPC HalpIdeDpcObject;
 
 VOID HalpInitPIC()
 {
@@ -227,6 +228,12 @@ VOID XBOXAPI HalpSmbusDpcRoutine(PKDPC Dpc, PVOID DeferredContext, PVOID SystemA
 	KeSetEvent(&HalpSmbusComplete, 0, FALSE);
 }
 
+VOID XBOXAPI HalpIdeDpcRoutine(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+	// The host raises the IDE interrupt when one or more I/O requests are complete
+	CompleteIoRequestsFromHost();
+}
+
 NTSTATUS HalpReadSMBusBlock(UCHAR SlaveAddress, UCHAR CommandCode, UCHAR ReadAmount, BYTE *Buffer)
 {
 	if ((ReadAmount == 0) || (ReadAmount > 32)) {
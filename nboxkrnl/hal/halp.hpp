@@ -84,6 +84,7 @@ extern BYTE HalpSmbusData[32];
 extern UCHAR HalpBlockAmount;
 extern KEVENT HalpSmbusLock;
 extern KEVENT HalpSmbusComplete;
+extern KDPC HalpIdeDpcObject;
 
 VOID XBOXAPI HalpSwIntApc();
 VOID XBOXAPI HalpSwIntDpc();
@@ -107,6 +108,7 @@ VOID XBOXAPI HalpHwInt15();
 VOID XBOXAPI HalpInterruptCommon();
 VOID XBOXAPI HalpClockIsr();
 VOID XBOXAPI HalpSmbusIsr();
+VOID XBOXAPI HalpIdeIsr();
 
 inline constexpr VOID(XBOXAPI *const SwIntHandlers[])() = {
 	&KiUnexpectedInterrupt,
@@ -138,6 +140,7 @@ VOID HalpInitSMCstate();
 VOID HalpReadCmosTime(PTIME_FIELDS TimeFields);
 VOID HalpCheckUnmaskedInt();
 VOID XBOXAPI HalpSmbusDpcRoutine(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+VOID XBOXAPI HalpIdeDpcRoutine(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
 VOID HalpExecuteReadSmbusCycle(UCHAR SlaveAddress, UCHAR CommandCode, BOOLEAN ReadWordValue);
 VOID HalpExecuteWriteSmbusCycle(UCHAR SlaveAddress, UCHAR CommandCode, BOOLEAN WriteWordValue, ULONG DataValue);
 VOID HalpExecuteBlockReadSmbusCycle(UCHAR SlaveAddress, UCHAR CommandCode);
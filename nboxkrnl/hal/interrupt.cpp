@@ -642,6 +642,45 @@ VOID __declspec(naked) XBOXAPI HalpSmbusIsr()
 	}
 }
 
+VOID __declspec(naked) XBOXAPI HalpIdeIsr()
+{
+	__asm {
+		CREATE_KTRAP_FRAME_FOR_INT;
+		mov al, OCW2_EOI_IRQ | 2
+		out PIC_MASTER_CMD, al // send eoi to master pic
+		movzx eax, byte ptr [KiPcr]KPCR.Irql
+		cmp eax, IDE_LEVEL
+		jge masked_int
+		mov byte ptr [KiPcr]KPCR.Irql, IDE_LEVEL // raise IRQL
+		push eax
+		sti
+		inc [KiPcr]KPCR.PrcbData.InterruptCount // InterruptCount: number of interrupts that have occurred
+		push 0
+		push 0
+		push offset HalpIdeDpcObject
+		call KeInsertQueueDpc
+		cli
+		mov eax, 14 + OCW2_EOI_IRQ - 8
+		out PIC_SLAVE_CMD, al // send eoi to slave pic
+		pop eax
+		mov byte ptr [KiPcr]KPCR.Irql, al // lower IRQL
+		call HalpCheckUnmaskedInt
+		jmp end_isr
+	masked_int:
+		mov edx, 1
+		mov ecx, 14 + IRQL_OFFSET_FOR_IRQ // ide IRQ is fourteen
+		shl edx, cl
+		or HalpPendingInt, edx // save masked int in sw IRR, so that we can deliver it later when the IRQL goes down
+		mov ax, PicIRQMasksForIRQL[eax * 2]
+		or ax, HalpIntDisabled // mask all IRQs on the PIC with IRQL <= than current IRQL
+		out PIC_MASTER_DATA, al
+		shr ax, 8
+		out PIC_SLAVE_DATA, al
+	end_isr:
+		EXIT_INTERRUPT;
+	}
+}
+
 EXPORTNUM(43) VOID XBOXAPI HalEnableSystemInterrupt
 (
 	ULONG BusInterruptLevel,
@@ -65,6 +65,16 @@ static NTSTATUS XisoCompleteRequest(PIRP Irp, NTSTATUS Status, PXISO_VOLUME_EXTE
 	return Status;
 }
 
+static VOID XBOXAPI XisoCompleteAsyncRead(IoInfoBlock InfoBlock, PVOID Context)
+{
+	// Called at DISPATCH_LEVEL from the IDE dpc
+
+	PIRP Irp = (PIRP)Context;
+	Irp->IoStatus.Information = InfoBlock.Info;
+	Irp->IoStatus.Status = HostToNtStatus(InfoBlock.Status);
+	IofCompleteRequest(Irp, PRIORITY_BOOST_IO);
+}
+
 static PXISO_FILE_INFO XisoFindOpenFile(PXISO_VOLUME_EXTENSION VolumeExtension, POBJECT_STRING Name)
 {
 	PXISO_FILE_INFO FileInfo = nullptr;
@@ -521,8 +531,35 @@ static NTSTATUS XBOXAPI XisoIrpRead(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 		}
 	}
 
+	IopMakeTransferResident(Irp, Buffer, Length);
+
+	ULONG RequestType = IoRequestType::Read;
+	if (Irp->Flags & IRP_SCATTER_GATHER_OPERATION) {
+		// The host transfers one page for each element of the segment array
+		RequestType = IoRequestType::ReadScatter;
+		Buffer = Irp->SegmentArray;
+	}
+
+	if (!(FileObject->Flags & FO_SYNCHRONOUS_IO)) {
+		// Mark the irp as pending before submitting it, because the dpc can complete it before SubmitIoRequestToHostAsync returns
+		IoMarkIrpPending(Irp);
+		if (SubmitIoRequestToHostAsync(
+			DEV_TYPE(DEV_CDROM) | RequestType,
+			FileOffset.LowPart,
+			Length,
+			(ULONG_PTR)Buffer,
+			FileInfo->HostHandle,
+			XisoCompleteAsyncRead,
+			Irp)) {
+			XisoVolumeUnlock(VolumeExtension);
+			return STATUS_PENDING;
+		}
+		// The host cannot complete the request asynchronously, so fall back to a synchronous request
+		IrpStackPointer->Control &= ~SL_PENDING_RETURNED;
+	}
+
 	IoInfoBlock InfoBlock = SubmitIoRequestToHost(
-		DEV_TYPE(DEV_CDROM) | IoRequestType::Read,
+		DEV_TYPE(DEV_CDROM) | RequestType,
 		FileOffset.LowPart,
 		Length,
 		(ULONG_PTR)Buffer,
@@ -530,11 +567,7 @@ static NTSTATUS XBOXAPI XisoIrpRead(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 	);
 
 	NTSTATUS Status = HostToNtStatus(InfoBlock.Status);
-	if (Status == STATUS_PENDING) {
-		// Should not happen right now, because RetrieveIoRequestFromHost is always synchronous
-		RIP_API_MSG("Asynchronous IO is not supported");
-	}
-	else if (NT_SUCCESS(Status)) {
+	if (NT_SUCCESS(Status)) {
 		if (FileObject->Flags & FO_SYNCHRONOUS_IO) {
 			// NOTE: despite the addition not being atomic, this is ok because on xiso the file size limit is 4 GiB, which means the high dword will always be zero with no carry to add to it
 			FileObject->CurrentByteOffset.QuadPart += InfoBlock.Info;
@@ -3,54 +3,314 @@
  */
 
 #include "fsc.hpp"
+#include "psp.hpp"
+#include "nt.hpp"
+#include "dbg.hpp"
 #include <string.h>
 #include <assert.h>
 
-#define MAX_NUMBER_OF_CACHE_PAGES 2048
+// NOTE: in this file, a cache page is a block of FSC_BLOCK_SIZE bytes, made of FSC_PAGES_PER_BLOCK contiguous pages of memory. The exports and the memory
+// manager count memory pages instead, so they are converted at the boundary
+#define MAX_NUMBER_OF_CACHE_PAGES 2048 // limited by the size of FscCache.Index in the pfn
+#define FSC_MAX_TRANSFER_PAGES 16 // memory pages transferred by a single scatter/gather request
+#define FSC_MAX_READ_AHEAD_PAGES (FSC_MAX_TRANSFER_PAGES / FSC_PAGES_PER_BLOCK)
+#define FSC_MIN_READ_AHEAD_PAGES (FSC_MAX_READ_AHEAD_PAGES < 2 ? FSC_MAX_READ_AHEAD_PAGES : 2)
+#define FSC_MAX_WRITE_BEHIND_PAGES FSC_MAX_READ_AHEAD_PAGES
+#define FSC_DIRTY_PAGES_THRESHOLD 256
+#define FSC_LAZY_WRITER_INTERVAL (1000 * 10000) // 1 second, in 100 ns units
+#define FSC_NUM_OF_ELEMENT_GATES 32
+#define FSC_NUM_OF_PARTITIONS (DEV_PARTITION7 - DEV_PARTITION0 + 1)
+#define FSC_TRACE_INTERVAL (10000 * 10000) // 10 seconds, in 100 ns units
+#define FSC_MIN_FREE_PAGES_TO_GROW 1024 // 4 MiB
+#define FSC_MIN_PAGES_TO_TRIM (16 / FSC_PAGES_PER_BLOCK ? 16 / FSC_PAGES_PER_BLOCK : 1)
+#define FSC_MAX_USERS_PER_PAGE 255 // the largest value that FSCACHE_ELEMENT::NumOfUsers can hold
+#define FSC_HASH_TABLE_SHIFT 12
+#define FSC_HASH_TABLE_SIZE (1 << FSC_HASH_TABLE_SHIFT)
+#define FSC_HASH_TABLE_MASK (FSC_HASH_TABLE_SIZE - 1)
+
+#define FSC_MAX_NUMBER_OF_GHOSTS (MAX_NUMBER_OF_CACHE_PAGES / 2)
+
+static_assert(FSC_HASH_TABLE_SIZE >= (MAX_NUMBER_OF_CACHE_PAGES * 2)); // keeps the load factor of the hash table at or below 0.5
+static_assert(FSC_PAGES_PER_BLOCK <= FSC_MAX_TRANSFER_PAGES);
+
+// The replacement policy is selected at build time with NBOXKRNL_FSC_POLICY. 2Q is the default, because it's not flushed by a large sequential scan
+#if !defined(FSC_REPLACEMENT_POLICY_LRU) && !defined(FSC_REPLACEMENT_POLICY_2Q)
+#define FSC_REPLACEMENT_POLICY_2Q
+#endif
 
 
 // Array that tracks information about each page allocated for file system cache usage
 static PFSCACHE_ELEMENT FscCacheElementArray = nullptr;
 
-// List of all cache elements currently allocated. Most recently used elements are at the tail, and least used are at the head
+// List of all valid cache elements. Most recently used elements are at the tail, and least used are at the head
 static LIST_ENTRY FscCacheElementListHead;
 
+// List of the invalid cache elements that can be reused right away, so that FscAllocateFreeElement doesn't need to search for them
+static LIST_ENTRY FscFreeElementListHead;
+
+// Open addressed hash table (with linear probing) of all valid cache elements, keyed on their extension and offset. Each slot holds the index of the element in
+// FscCacheElementArray plus one, so that zero marks an empty slot
+static USHORT FscCacheElementHashTable[FSC_HASH_TABLE_SIZE];
+
+#ifdef FSC_REPLACEMENT_POLICY_2Q
+// 2Q keeps pages referenced only once in the A1in fifo, and only promotes them to the lru list (Am, which is FscCacheElementListHead) when they are referenced
+// again after being evicted from A1in. The keys of the pages evicted from A1in are remembered in the A1out ghost fifo, which is indexed by its own hash table
+struct FSCACHE_GHOST {
+	PFSCACHE_EXTENSION CacheExtension;
+	ULONG AlignedByteOffset;
+};
+
+static LIST_ENTRY FscA1InListHead;
+static ULONG FscNumOfA1InPages = 0;
+static FSCACHE_GHOST FscGhostArray[FSC_MAX_NUMBER_OF_GHOSTS];
+static ULONG FscGhostHead = 0;
+static ULONG FscNumOfGhosts = 0;
+static USHORT FscGhostHashTable[FSC_HASH_TABLE_SIZE];
+
+static PLIST_ENTRY const FscCacheElementLists[] = { &FscFreeElementListHead, &FscCacheElementListHead, &FscA1InListHead };
+#else
+static PLIST_ENTRY const FscCacheElementLists[] = { &FscFreeElementListHead, &FscCacheElementListHead };
+#endif
+
+// Statistics of the cache for each partition of the hdd. They are shared by the partition and all the files on it, and are protected by the Mm lock
+static FSCACHE_STATISTICS FscPartitionStatistics[FSC_NUM_OF_PARTITIONS];
+
 static INITIALIZE_GLOBAL_KEVENT(FscUpdateNumOfPages, SynchronizationEvent, TRUE);
-static INITIALIZE_GLOBAL_KEVENT(FscConcurrentWriteEvent, NotificationEvent, FALSE);
 static INITIALIZE_GLOBAL_KEVENT(FscReleasedPagesEvent, SynchronizationEvent, FALSE);
+static INITIALIZE_GLOBAL_KEVENT(FscLazyWriterEvent, SynchronizationEvent, FALSE);
+
+// Threads that find a page busy wait on the gate its key hashes to, so that releasing a page only wakes up the threads waiting on pages of the same bucket
+static KEVENT FscElementGates[FSC_NUM_OF_ELEMENT_GATES];
+
+static NTSTATUS FscResizeCache(ULONG NumberOfCachePages);
+
+
+static PFSCACHE_STATISTICS FscGetStatistics(PFSCACHE_EXTENSION CacheExtension)
+{
+	assert((CacheExtension->DeviceType >= DEV_PARTITION0) && (CacheExtension->DeviceType <= DEV_PARTITION7));
 
+	return &FscPartitionStatistics[CacheExtension->DeviceType - DEV_PARTITION0];
+}
 
 static ULONG FscByteOffsetToAlignedOffset(ULONGLONG ByteOffset)
 {
 	// Note that this cannot cause a truncation error because an xbox HDD is only 8/10 GiB large
 
-	return (ULONG)(ByteOffset >> PAGE_SHIFT);
+	return (ULONG)(ByteOffset >> FSC_BLOCK_SHIFT);
 }
 
-static PFSCACHE_ELEMENT FscFindElement(PFSCACHE_EXTENSION CacheExtension, ULONG AlignedByteOffset)
+static VOID FscSetElementIndex(PVOID CacheBuffer, ULONG Index)
+{
+	// All the pages of the block point to the element, so that FscFindElement works with any address inside of it
+	PMMPTE Pte = GetPteAddress(CacheBuffer);
+	for (ULONG PageIndex = 0; PageIndex < FSC_PAGES_PER_BLOCK; ++PageIndex, ++Pte) {
+		PXBOX_PFN Pfn = GetPfnElement(Pte->Hw >> PAGE_SHIFT);
+		Pfn->FscCache.Index = Index;
+	}
+}
+
+static VOID FscAddBlockToSegmentArray(PFILE_SEGMENT_ELEMENT SegmentArray, ULONG BlockIndex, PFSCACHE_ELEMENT Element)
+{
+	// The host transfers one memory page for each element of the segment array, so a block takes FSC_PAGES_PER_BLOCK of them
+	PCHAR Buffer = PCHAR(ULONG(Element->CacheBuffer) & ~PAGE_MASK);
+	for (ULONG PageIndex = 0; PageIndex < FSC_PAGES_PER_BLOCK; ++PageIndex) {
+		SegmentArray[BlockIndex * FSC_PAGES_PER_BLOCK + PageIndex].Buffer = Buffer + (PageIndex << PAGE_SHIFT);
+	}
+}
+
+static ULONG FscHashElement(PFSCACHE_EXTENSION CacheExtension, ULONG AlignedByteOffset)
+{
+	// Fibonacci hashing, which spreads consecutive offsets of the same partition over the whole table
+
+	return ((ULONG(CacheExtension) ^ (AlignedByteOffset * 0x9E3779B1)) * 0x9E3779B1) >> (32 - FSC_HASH_TABLE_SHIFT);
+}
+
+static VOID FscInsertElementInHashTable(PFSCACHE_ELEMENT Element)
 {
 	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-	PLIST_ENTRY Entry = FscCacheElementListHead.Blink;
-	while (Entry != &FscCacheElementListHead) {
-		PFSCACHE_ELEMENT Element = CONTAINING_RECORD(Entry, FSCACHE_ELEMENT, ListEntry);
-		if ((Element->CacheExtension == CacheExtension) && (Element->AlignedByteOffset == AlignedByteOffset)) {
-			RemoveEntryList(&Element->ListEntry);
-			InsertTailList(&FscCacheElementListHead, &Element->ListEntry);
+	ULONG Slot = FscHashElement(Element->CacheExtension, Element->AlignedByteOffset);
+	while (FscCacheElementHashTable[Slot]) {
+		Slot = (Slot + 1) & FSC_HASH_TABLE_MASK;
+	}
 
-			return Element;
+	FscCacheElementHashTable[Slot] = USHORT(Element - FscCacheElementArray + 1);
+}
+
+static VOID FscDeleteHashTableSlot(PUSHORT HashTable, ULONG Slot, ULONG(*GetHomeSlot)(USHORT SlotValue))
+{
+	// Backward shift deletion: move back the following entries of the same probe sequence, so that lookups never need tombstones
+
+	HashTable[Slot] = 0;
+	ULONG NextSlot = (Slot + 1) & FSC_HASH_TABLE_MASK;
+	while (HashTable[NextSlot]) {
+		ULONG HomeSlot = GetHomeSlot(HashTable[NextSlot]);
+		if (((NextSlot - HomeSlot) & FSC_HASH_TABLE_MASK) >= ((NextSlot - Slot) & FSC_HASH_TABLE_MASK)) {
+			HashTable[Slot] = HashTable[NextSlot];
+			HashTable[NextSlot] = 0;
+			Slot = NextSlot;
 		}
 
-		if (Element->CacheExtension == nullptr) {
-			break;
+		NextSlot = (NextSlot + 1) & FSC_HASH_TABLE_MASK;
+	}
+}
+
+static ULONG FscGetElementHomeSlot(USHORT SlotValue)
+{
+	PFSCACHE_ELEMENT Element = &FscCacheElementArray[SlotValue - 1];
+	return FscHashElement(Element->CacheExtension, Element->AlignedByteOffset);
+}
+
+static VOID FscRemoveElementFromHashTable(PFSCACHE_ELEMENT Element)
+{
+	// NOTE: this must be called before the CacheExtension of the element is cleared, since it's part of the key
+
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	USHORT ElementSlotValue = USHORT(Element - FscCacheElementArray + 1);
+	ULONG Slot = FscHashElement(Element->CacheExtension, Element->AlignedByteOffset);
+	while (FscCacheElementHashTable[Slot] != ElementSlotValue) {
+		assert(FscCacheElementHashTable[Slot]);
+		Slot = (Slot + 1) & FSC_HASH_TABLE_MASK;
+	}
+
+	FscDeleteHashTableSlot(FscCacheElementHashTable, Slot, FscGetElementHomeSlot);
+}
+
+#ifdef FSC_REPLACEMENT_POLICY_2Q
+static ULONG FscGetGhostHomeSlot(USHORT SlotValue)
+{
+	FSCACHE_GHOST *Ghost = &FscGhostArray[SlotValue - 1];
+	return FscHashElement(Ghost->CacheExtension, Ghost->AlignedByteOffset);
+}
+
+static BOOLEAN FscRemoveGhost(PFSCACHE_EXTENSION CacheExtension, ULONG AlignedByteOffset)
+{
+	// Returns TRUE if the page was in the ghost fifo. Its entry in the fifo is only marked as free, and it's reclaimed when it becomes the oldest one
+
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	ULONG Slot = FscHashElement(CacheExtension, AlignedByteOffset);
+	while (FscGhostHashTable[Slot]) {
+		FSCACHE_GHOST *Ghost = &FscGhostArray[FscGhostHashTable[Slot] - 1];
+		if ((Ghost->CacheExtension == CacheExtension) && (Ghost->AlignedByteOffset == AlignedByteOffset)) {
+			FscDeleteHashTableSlot(FscGhostHashTable, Slot, FscGetGhostHomeSlot);
+			Ghost->CacheExtension = nullptr;
+			return TRUE;
+		}
+
+		Slot = (Slot + 1) & FSC_HASH_TABLE_MASK;
+	}
+
+	return FALSE;
+}
+
+static VOID FscInsertGhost(PFSCACHE_ELEMENT Element)
+{
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	// A1out remembers as many pages as half of the cache
+	ULONG MaxNumOfGhosts = FscCurrNumberOfCachePages / 2;
+	MaxNumOfGhosts = MaxNumOfGhosts > FSC_MAX_NUMBER_OF_GHOSTS ? FSC_MAX_NUMBER_OF_GHOSTS : (MaxNumOfGhosts ? MaxNumOfGhosts : 1);
+	while (FscNumOfGhosts >= MaxNumOfGhosts) {
+		FSCACHE_GHOST *OldestGhost = &FscGhostArray[FscGhostHead];
+		if (OldestGhost->CacheExtension) {
+			FscRemoveGhost(OldestGhost->CacheExtension, OldestGhost->AlignedByteOffset);
+		}
+		FscGhostHead = (FscGhostHead + 1) % FSC_MAX_NUMBER_OF_GHOSTS;
+		--FscNumOfGhosts;
+	}
+
+	ULONG Index = (FscGhostHead + FscNumOfGhosts) % FSC_MAX_NUMBER_OF_GHOSTS;
+	FscGhostArray[Index].CacheExtension = Element->CacheExtension;
+	FscGhostArray[Index].AlignedByteOffset = Element->AlignedByteOffset;
+	++FscNumOfGhosts;
+
+	ULONG Slot = FscHashElement(Element->CacheExtension, Element->AlignedByteOffset);
+	while (FscGhostHashTable[Slot]) {
+		Slot = (Slot + 1) & FSC_HASH_TABLE_MASK;
+	}
+
+	FscGhostHashTable[Slot] = USHORT(Index + 1);
+}
+#endif
+
+static VOID FscInvalidateElement(PFSCACHE_ELEMENT Element)
+{
+	// NOTE: the element must not have any users, because then it can be reused as soon as it's on the free list
+
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+	assert(Element->NumOfUsers == 0);
+
+	FscRemoveElementFromHashTable(Element);
+	Element->CacheExtension = nullptr;
+	RemoveEntryList(&Element->ListEntry);
+	InsertTailList(&FscFreeElementListHead, &Element->ListEntry);
+#ifdef FSC_REPLACEMENT_POLICY_2Q
+	if (Element->InA1) {
+		Element->InA1 = 0;
+		--FscNumOfA1InPages;
+	}
+#endif
+}
+
+static VOID FscQueueNewElement(PFSCACHE_ELEMENT Element)
+{
+	// Called when a page is brought in the cache, after FscAllocateFreeElement has put its element at the tail of FscCacheElementListHead
+
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+#ifdef FSC_REPLACEMENT_POLICY_2Q
+	// A page that is still in the ghost fifo was referenced again after a while, so it's promoted to Am. Otherwise, it starts in A1in
+	if (FscRemoveGhost(Element->CacheExtension, Element->AlignedByteOffset) == FALSE) {
+		RemoveEntryList(&Element->ListEntry);
+		InsertTailList(&FscA1InListHead, &Element->ListEntry);
+		Element->InA1 = 1;
+		++FscNumOfA1InPages;
+	}
+#endif
+}
+
+static PFSCACHE_ELEMENT FscLookupElement(PFSCACHE_EXTENSION CacheExtension, ULONG AlignedByteOffset)
+{
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	ULONG Slot = FscHashElement(CacheExtension, AlignedByteOffset);
+	while (FscCacheElementHashTable[Slot]) {
+		PFSCACHE_ELEMENT Element = &FscCacheElementArray[FscCacheElementHashTable[Slot] - 1];
+		if ((Element->CacheExtension == CacheExtension) && (Element->AlignedByteOffset == AlignedByteOffset)) {
+			return Element;
 		}
 
-		Entry = Element->ListEntry.Blink;
+		Slot = (Slot + 1) & FSC_HASH_TABLE_MASK;
 	}
 
 	return nullptr;
 }
 
+static PFSCACHE_ELEMENT FscFindElement(PFSCACHE_EXTENSION CacheExtension, ULONG AlignedByteOffset)
+{
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	PFSCACHE_ELEMENT Element = FscLookupElement(CacheExtension, AlignedByteOffset);
+	if (Element) {
+		// With 2Q, hits in A1in don't change the order of the fifo, because they are likely to be correlated references to the same page
+#ifdef FSC_REPLACEMENT_POLICY_2Q
+		if (Element->InA1 == 0)
+#endif
+		{
+			RemoveEntryList(&Element->ListEntry);
+			InsertTailList(&FscCacheElementListHead, &Element->ListEntry);
+		}
+		++FscGetStatistics(CacheExtension)->Hits;
+	}
+	else {
+		++FscGetStatistics(CacheExtension)->Misses;
+	}
+
+	return Element;
+}
+
 static PFSCACHE_ELEMENT FscFindElement(PVOID CacheBuffer)
 {
 	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
@@ -61,41 +321,296 @@ static PFSCACHE_ELEMENT FscFindElement(PVOID CacheBuffer)
 	return &FscCacheElementArray[Pfn->FscCache.Index];
 }
 
-static PFSCACHE_ELEMENT FscAllocateFreeElement()
+static ULONG FscGetReadAheadPages(PFSCACHE_EXTENSION CacheExtension)
+{
+	return CacheExtension->ReadAheadPages < FSC_MIN_READ_AHEAD_PAGES ? FSC_MIN_READ_AHEAD_PAGES : CacheExtension->ReadAheadPages;
+}
+
+static PFSCACHE_ELEMENT FscFindEvictableElement(PLIST_ENTRY ListHead)
 {
 	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-	PLIST_ENTRY Entry = FscCacheElementListHead.Flink;
-	while (Entry != &FscCacheElementListHead) {
+	// Dirty elements can only be reused after the lazy writer has written them back to the host
+	PLIST_ENTRY Entry = ListHead->Flink;
+	while (Entry != ListHead) {
 		PFSCACHE_ELEMENT Element = CONTAINING_RECORD(Entry, FSCACHE_ELEMENT, ListEntry);
-		if (Element->CacheExtension == nullptr) {
+		if (Element->CacheExtension && (Element->NumOfUsers == 0) && (Element->MarkForDeletion == 0) && (Element->Dirty == 0)) {
 			return Element;
 		}
 
-		Entry = Element->ListEntry.Blink;
+		Entry = Element->ListEntry.Flink;
+	}
+
+	return nullptr;
+}
+
+static PFSCACHE_ELEMENT FscAllocateFreeElement(BOOLEAN CanGrowCache)
+{
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	if (!IsListEmpty(&FscFreeElementListHead)) {
+		PFSCACHE_ELEMENT Element = CONTAINING_RECORD(RemoveHeadList(&FscFreeElementListHead), FSCACHE_ELEMENT, ListEntry);
+		assert((Element->NumOfUsers == 0) && (Element->MarkForDeletion == 0) && (Element->CacheExtension == nullptr));
+		InsertTailList(&FscCacheElementListHead, &Element->ListEntry);
+		return Element;
+	}
+
+	// NOTE: growing the cache reallocates FscCacheElementArray, so callers that still hold pointers to other elements must not allow it
+	// Only grow while free memory is plentiful, otherwise the pages would just have to be trimmed again by the next allocation that runs short
+	if (ULONG PagesToLeftToAllocate = MAX_NUMBER_OF_CACHE_PAGES - FscCurrNumberOfCachePages;
+		CanGrowCache && PagesToLeftToAllocate && (MiRetailRegion.PagesAvailable > FSC_MIN_FREE_PAGES_TO_GROW)) {
+		if (NT_SUCCESS(FscResizeCache(FscCurrNumberOfCachePages + (16 < PagesToLeftToAllocate ? 16 : PagesToLeftToAllocate)))) {
+			return FscAllocateFreeElement(FALSE); // can't fail now
+		}
+	}
+
+	// The cache cannot grow anymore, so evict an element that nobody is using
+	PFSCACHE_ELEMENT Victim = nullptr;
+#ifdef FSC_REPLACEMENT_POLICY_2Q
+	// A1in is allowed to hold a quarter of the cache, so that a scan can only evict pages that were referenced once
+	if (FscNumOfA1InPages > (FscCurrNumberOfCachePages / 4)) {
+		Victim = FscFindEvictableElement(&FscA1InListHead);
+	}
+#endif
+	if (Victim == nullptr) {
+		Victim = FscFindEvictableElement(&FscCacheElementListHead);
+	}
+#ifdef FSC_REPLACEMENT_POLICY_2Q
+	if (Victim == nullptr) {
+		Victim = FscFindEvictableElement(&FscA1InListHead);
+	}
+#endif
+
+	if (Victim) {
+		if (Victim->ReadAhead) {
+			// This page was read ahead but never used, so shrink the read-ahead window of its partition
+			PFSCACHE_EXTENSION CacheExtension = Victim->CacheExtension;
+			CacheExtension->ReadAheadPages = FscGetReadAheadPages(CacheExtension) / 2;
+			Victim->ReadAhead = 0;
+		}
+#ifdef FSC_REPLACEMENT_POLICY_2Q
+		if (Victim->InA1) {
+			FscInsertGhost(Victim);
+		}
+#endif
+		++FscGetStatistics(Victim->CacheExtension)->Evictions;
+		FscInvalidateElement(Victim);
+		RemoveEntryList(&Victim->ListEntry);
+		InsertTailList(&FscCacheElementListHead, &Victim->ListEntry);
+	}
+
+	return Victim;
+}
+
+static PKEVENT FscGetElementGate(PFSCACHE_EXTENSION CacheExtension, ULONG AlignedByteOffset)
+{
+	return &FscElementGates[FscHashElement(CacheExtension, AlignedByteOffset) & (FSC_NUM_OF_ELEMENT_GATES - 1)];
+}
+
+static VOID FscWaitWithMiLockHeld(PKEVENT Event, KIRQL OldIrql)
+{
+	// Starts the wait before the Mm lock is released, so that a thread releasing the page cannot signal the event before this thread is waiting on it. Because
+	// MiLock is the same as the dispatcher lock, this is the same as what KeSetEvent does when its Wait argument is TRUE. Returns with the Mm lock released
+
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	PKTHREAD Thread = KeGetCurrentThread();
+	Thread->WaitIrql = OldIrql;
+	Thread->WaitNext = TRUE;
+	KeWaitForSingleObject(Event, Executive, KernelMode, FALSE, nullptr);
+}
+
+static VOID FscSignalReleasedElement(PFSCACHE_ELEMENT Element)
+{
+	// NOTE: this must be called before the CacheExtension of the element is cleared, since it selects the gate
+
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	if ((Element->NumOfUsers == 0) && (IsListEmpty(&FscReleasedPagesEvent.Header.WaitListHead) == FALSE)) {
+		KeSetEvent(&FscReleasedPagesEvent, 0, FALSE);
 	}
 
-	ULONG PagesToLeftToAllocate = MAX_NUMBER_OF_CACHE_PAGES - FscCurrNumberOfCachePages;
-	if (!NT_SUCCESS(FscSetCacheSize(FscCurrNumberOfCachePages + (16 < PagesToLeftToAllocate ? 16 : PagesToLeftToAllocate)))) {
+	// Pulse the gate, the woken threads will check again if the page they want is available
+	PKEVENT Gate = FscGetElementGate(Element->CacheExtension, Element->AlignedByteOffset);
+	if (IsListEmpty(&Gate->Header.WaitListHead) == FALSE) {
+		KeSetEvent(Gate, 0, FALSE);
+		Gate->Header.SignalState = 0;
+	}
+}
+
+static BOOLEAN FscCanWriteBackElement(PFSCACHE_ELEMENT Element)
+{
+	return Element->Dirty && (Element->NumOfUsers == 0) && (Element->WriteInProgress == 0) && (Element->MarkForDeletion == 0);
+}
+
+static PFSCACHE_ELEMENT FscFindDirtyRun(PFSCACHE_EXTENSION CacheExtension)
+{
+	// Returns the first element of a run of dirty pages that can be written back, or nullptr if there are none. When CacheExtension is nullptr, all partitions
+	// are considered
+
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	if (FscNumOfDirtyPages == 0) {
 		return nullptr;
 	}
 
-	return FscAllocateFreeElement(); // can't fail now
+	for (PLIST_ENTRY ListHead : FscCacheElementLists) {
+		PLIST_ENTRY Entry = ListHead->Flink;
+		while (Entry != ListHead) {
+			PFSCACHE_ELEMENT Element = CONTAINING_RECORD(Entry, FSCACHE_ELEMENT, ListEntry);
+			if (((CacheExtension == nullptr) || (Element->CacheExtension == CacheExtension)) && FscCanWriteBackElement(Element)) {
+				while (Element->AlignedByteOffset) {
+					PFSCACHE_ELEMENT PrevElement = FscLookupElement(Element->CacheExtension, Element->AlignedByteOffset - 1);
+					if ((PrevElement == nullptr) || !FscCanWriteBackElement(PrevElement)) {
+						break;
+					}
+					Element = PrevElement;
+				}
+
+				return Element;
+			}
+
+			Entry = Element->ListEntry.Flink;
+		}
+	}
+
+	return nullptr;
+}
+
+static ULONG FscWriteDirtyElements(PFSCACHE_EXTENSION CacheExtension)
+{
+	// Writes back the dirty pages that nobody is using, and returns how many pages were written. Dirty pages that are adjacent on the partition are coalesced
+	// in a single gather request
+
+	ULONG NumOfPagesWritten = 0;
+	KIRQL OldIrql = MiLock();
+
+	while (PFSCACHE_ELEMENT Element = FscFindDirtyRun(CacheExtension)) {
+		FILE_SEGMENT_ELEMENT SegmentArray[FSC_MAX_TRANSFER_PAGES];
+		PFSCACHE_EXTENSION RunCacheExtension = Element->CacheExtension;
+		ULONG AlignedByteOffset = Element->AlignedByteOffset;
+		ULONG NumOfPages = 0;
+		do {
+			// Take a reference so that the page cannot be removed or mapped for writing while it's being written back. Readers can still map it
+			Element->NumOfUsers = 1;
+			Element->WriteBack = 1;
+			Element->Dirty = 0;
+			--FscNumOfDirtyPages;
+			--FscGetStatistics(RunCacheExtension)->NumOfDirtyPages;
+			FscAddBlockToSegmentArray(SegmentArray, NumOfPages, Element);
+			++NumOfPages;
+			if (NumOfPages == FSC_MAX_WRITE_BEHIND_PAGES) {
+				break;
+			}
+			Element = FscLookupElement(RunCacheExtension, AlignedByteOffset + NumOfPages);
+		} while (Element && FscCanWriteBackElement(Element));
+
+		MiUnlock(OldIrql);
+
+		// Don't write past the end of the partition, or of the file when the pages belong to a file, which doesn't necessarily end on a page boundary
+		ULONGLONG ByteOffset = (ULONGLONG)AlignedByteOffset << FSC_BLOCK_SHIFT;
+		ULONG Length = NumOfPages << FSC_BLOCK_SHIFT;
+		if (RunCacheExtension->PartitionLength.QuadPart && ((ByteOffset + Length) > (ULONGLONG)RunCacheExtension->PartitionLength.QuadPart)) {
+			Length = ULONG(RunCacheExtension->PartitionLength.QuadPart - ByteOffset);
+		}
+
+		IoInfoBlock InfoBlock;
+		if (NumOfPages == 1) {
+			InfoBlock = SubmitIoRequestToHost(
+				IoRequestType::Write | DEV_TYPE(RunCacheExtension->DeviceType),
+				ByteOffset,
+				Length,
+				ULONG(SegmentArray[0].Buffer),
+				RunCacheExtension->HostHandle
+			);
+		}
+		else {
+			InfoBlock = SubmitIoRequestToHost(
+				IoRequestType::WriteGather | DEV_TYPE(RunCacheExtension->DeviceType),
+				ByteOffset,
+				Length,
+				ULONG(SegmentArray),
+				RunCacheExtension->HostHandle
+			);
+		}
+
+		OldIrql = MiLock();
+
+		NTSTATUS Status = HostToNtStatus(InfoBlock.Status);
+		for (ULONG Index = 0; Index < NumOfPages; ++Index) {
+			Element = FscFindElement(SegmentArray[Index * FSC_PAGES_PER_BLOCK].Buffer);
+			--Element->NumOfUsers;
+			Element->WriteBack = 0;
+			if (Status != STATUS_SUCCESS) {
+				Element->Dirty = 1;
+				++FscNumOfDirtyPages;
+				++FscGetStatistics(RunCacheExtension)->NumOfDirtyPages;
+			}
+			FscSignalReleasedElement(Element);
+		}
+
+		// Give up on a host error, the pages will be retried on the next pass of the lazy writer
+		if (Status != STATUS_SUCCESS) {
+			break;
+		}
+
+		NumOfPagesWritten += NumOfPages;
+	}
+
+	MiUnlock(OldIrql);
+
+	return NumOfPagesWritten;
+}
+
+static VOID XBOXAPI FscLazyWriterThread(PVOID StartContext)
+{
+#ifdef FSC_TRACE_STATISTICS
+	ULONGLONG LastTraceTime = KeQueryInterruptTime();
+#endif
+
+	while (true) {
+		// Wake up periodically, or earlier when too many pages are dirty
+		LARGE_INTEGER Timeout{ .QuadPart = -FSC_LAZY_WRITER_INTERVAL };
+		KeWaitForSingleObject(&FscLazyWriterEvent, Executive, KernelMode, FALSE, &Timeout);
+		FscWriteDirtyElements(nullptr);
+
+#ifdef FSC_TRACE_STATISTICS
+		if (ULONGLONG CurrentTime = KeQueryInterruptTime(); (CurrentTime - LastTraceTime) >= FSC_TRACE_INTERVAL) {
+			FscDumpStatistics();
+			LastTraceTime = CurrentTime;
+		}
+#endif
+	}
 }
 
 static VOID FscReBuildCacheElementList()
 {
 	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-	// At the end of this function, valid elements are at the tail of the list, while invalid ones are at the head
+	// At the end of this function, valid elements are in their lists while invalid ones are in the free list. Element indices can change when the array
+	// is reallocated, so the hash table is rebuilt too
 	InitializeListHead(&FscCacheElementListHead);
+	InitializeListHead(&FscFreeElementListHead);
+	memset(FscCacheElementHashTable, 0, sizeof(FscCacheElementHashTable));
+#ifdef FSC_REPLACEMENT_POLICY_2Q
+	InitializeListHead(&FscA1InListHead);
+#endif
 
 	for (ULONG Index = 0; Index < FscCurrNumberOfCachePages; ++Index) {
 		if (FscCacheElementArray[Index].CacheExtension) {
-			InsertTailList(&FscCacheElementListHead, &FscCacheElementArray[Index].ListEntry);
+#ifdef FSC_REPLACEMENT_POLICY_2Q
+			if (FscCacheElementArray[Index].InA1) {
+				InsertTailList(&FscA1InListHead, &FscCacheElementArray[Index].ListEntry);
+			}
+			else
+#endif
+			{
+				InsertTailList(&FscCacheElementListHead, &FscCacheElementArray[Index].ListEntry);
+			}
+			FscInsertElementInHashTable(&FscCacheElementArray[Index]);
 		}
 		else {
-			InsertHeadList(&FscCacheElementListHead, &FscCacheElementArray[Index].ListEntry);
+			InsertTailList(&FscFreeElementListHead, &FscCacheElementArray[Index].ListEntry);
 		}
 	}
 }
@@ -110,7 +625,7 @@ static NTSTATUS FscIncreaseCacheSize(ULONG NumberOfCachePages)
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
-	PCHAR CacheBuffer = (PCHAR)MiAllocateSystemMemory((NumberOfCachePages - FscCurrNumberOfCachePages) << PAGE_SHIFT, PAGE_READWRITE, Cache, FALSE);
+	PCHAR CacheBuffer = (PCHAR)MiAllocateSystemMemory((NumberOfCachePages - FscCurrNumberOfCachePages) << FSC_BLOCK_SHIFT, PAGE_READWRITE, Cache, FALSE);
 	if (CacheBuffer == nullptr) {
 		ExFreePool(NewFscCacheElementArray);
 		return STATUS_INSUFFICIENT_RESOURCES;
@@ -120,11 +635,10 @@ static NTSTATUS FscIncreaseCacheSize(ULONG NumberOfCachePages)
 
 	for (ULONG Index = FscCurrNumberOfCachePages; Index < NumberOfCachePages; ++Index) {
 		NewFscCacheElementArray[Index].CacheExtension = nullptr; // marks the element as invalid
-		NewFscCacheElementArray[Index].CacheBuffer = CacheBuffer; // clears all flag bits
-		PMMPTE Pte = GetPteAddress(CacheBuffer);
-		PXBOX_PFN Pfn = GetPfnElement(Pte->Hw >> PAGE_SHIFT);
-		Pfn->FscCache.Index = Index;
-		CacheBuffer += PAGE_SIZE;
+		NewFscCacheElementArray[Index].CacheBuffer = CacheBuffer; // clears NumOfUsers and the flag bits that share its word
+		NewFscCacheElementArray[Index].Flags = 0;
+		FscSetElementIndex(CacheBuffer, Index);
+		CacheBuffer += FSC_BLOCK_SIZE;
 	}
 
 	ExFreePool(FscCacheElementArray);
@@ -137,62 +651,74 @@ static NTSTATUS FscIncreaseCacheSize(ULONG NumberOfCachePages)
 	return STATUS_SUCCESS;
 }
 
-static NTSTATUS FscReduceCacheSize(ULONG NumberOfCachePages)
+static NTSTATUS FscReduceCacheSize(ULONG NumberOfCachePages, BOOLEAN Wait)
 {
 	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
 	assert(NumberOfCachePages < FscCurrNumberOfCachePages);
 
-	PFSCACHE_ELEMENT NewFscCacheElementArray;
-	if (NumberOfCachePages == 0) {
-		NewFscCacheElementArray = nullptr;
-	}
-	else {
-		ULONG SizeOfNewCacheElementArray = sizeof(FSCACHE_ELEMENT) * NumberOfCachePages;
-		NewFscCacheElementArray = (PFSCACHE_ELEMENT)ExAllocatePoolWithTag(SizeOfNewCacheElementArray, 'AcsF');
-		if (NewFscCacheElementArray == nullptr) {
-			return STATUS_INSUFFICIENT_RESOURCES;
-		}
-	}
-
 	ULONG NumOfPagesToDelete = FscCurrNumberOfCachePages - NumberOfCachePages;
 Retry:
-	PLIST_ENTRY Entry = FscCacheElementListHead.Flink;
-	while (Entry != &FscCacheElementListHead) {
-		PFSCACHE_ELEMENT Element = CONTAINING_RECORD(Entry, FSCACHE_ELEMENT, ListEntry);
-		if ((Element->NumOfUsers == 0) && (Element->MarkForDeletion == 0)) {
-			Element->MarkForDeletion = 1;
-			Element->CacheExtension = nullptr;
-			--NumOfPagesToDelete;
-			if (NumOfPagesToDelete == 0) {
-				break;
+	for (PLIST_ENTRY ListHead : FscCacheElementLists) {
+		PLIST_ENTRY Entry = ListHead->Flink;
+		while ((Entry != ListHead) && NumOfPagesToDelete) {
+			PFSCACHE_ELEMENT Element = CONTAINING_RECORD(Entry, FSCACHE_ELEMENT, ListEntry);
+			Entry = Element->ListEntry.Flink;
+			if ((Element->NumOfUsers == 0) && (Element->MarkForDeletion == 0) && (Element->Dirty == 0)) {
+				// Take the element out of all lists, so that other threads can't reuse it while this one waits for the other pages
+				Element->MarkForDeletion = 1;
+				if (Element->CacheExtension) {
+					FscInvalidateElement(Element);
+				}
+				RemoveEntryList(&Element->ListEntry);
+				--NumOfPagesToDelete;
 			}
 		}
 	}
 
+	if (NumOfPagesToDelete && !Wait) {
+		// Only release the pages that are idle right now
+		NumberOfCachePages += NumOfPagesToDelete;
+		NumOfPagesToDelete = 0;
+		if (NumberOfCachePages == FscCurrNumberOfCachePages) {
+			return STATUS_SUCCESS;
+		}
+	}
+
 	if (NumOfPagesToDelete) {
 		// NOTE: when this is called, this thread holds the FscUpdateNumOfPages lock, so FscCurrNumberOfCachePages cannot change after the IRQL is lowered
-		MiUnlock(PASSIVE_LEVEL);
-		KeWaitForSingleObject(&FscReleasedPagesEvent, Executive, KernelMode, FALSE, nullptr);
+		// Dirty pages become reusable once written back, so only wait when there are none left that this thread can write
+		if (FscFindDirtyRun(nullptr)) {
+			MiUnlock(PASSIVE_LEVEL);
+			FscWriteDirtyElements(nullptr);
+		}
+		else {
+			FscWaitWithMiLockHeld(&FscReleasedPagesEvent, PASSIVE_LEVEL);
+		}
 		MiLock();
 		goto Retry;
 	}
 
+	// Free the marked pages and compact the surviving elements at the start of the array. This never allocates, since the trim is often done
+	// exactly when the system is short of memory. The array keeps its old allocation, and the lists and the hash table are rebuilt below
 	for (ULONG NewIndex = 0, Index = 0; Index < FscCurrNumberOfCachePages; ++Index) {
 		if (FscCacheElementArray[Index].MarkForDeletion) {
-			NumOfPagesToDelete += (MiFreeSystemMemory(FscCacheElementArray[Index].CacheBuffer, PAGE_SIZE) >> PAGE_SHIFT);
+			// NOTE: MiFreeSystemMemory expects a page aligned address and returns the number of memory pages freed
+			NumOfPagesToDelete += (MiFreeSystemMemory(PVOID(ULONG(FscCacheElementArray[Index].CacheBuffer) & ~PAGE_MASK), FSC_BLOCK_SIZE) / FSC_PAGES_PER_BLOCK);
 		}
 		else {
-			// NOTE: this case is not triggered when NumberOfCachePages == 0, because the above loop will mark all elements for deletion
-			NewFscCacheElementArray[NewIndex] = FscCacheElementArray[Index];
+			// NOTE: NewIndex is never above Index, so this doesn't overwrite an element that still has to be visited
+			FscCacheElementArray[NewIndex] = FscCacheElementArray[Index];
+			FscSetElementIndex(FscCacheElementArray[NewIndex].CacheBuffer, NewIndex);
 			++NewIndex;
 		}
 	}
 
 	assert(NumOfPagesToDelete == (FscCurrNumberOfCachePages - NumberOfCachePages));
 
-	ExFreePool(FscCacheElementArray);
-
-	FscCacheElementArray = NewFscCacheElementArray;
+	if (NumberOfCachePages == 0) {
+		ExFreePool(FscCacheElementArray);
+		FscCacheElementArray = nullptr;
+	}
 	FscCurrNumberOfCachePages = NumberOfCachePages;
 
 	FscReBuildCacheElementList();
@@ -200,49 +726,109 @@ Retry:
 	return STATUS_SUCCESS;
 }
 
+BOOLEAN FscInitSystem()
+{
+	InitializeListHead(&FscCacheElementListHead);
+	InitializeListHead(&FscFreeElementListHead);
+#ifdef FSC_REPLACEMENT_POLICY_2Q
+	InitializeListHead(&FscA1InListHead);
+#endif
+
+	for (ULONG Index = 0; Index < FSC_NUM_OF_ELEMENT_GATES; ++Index) {
+		KeInitializeEvent(&FscElementGates[Index], NotificationEvent, FALSE);
+	}
+
+	HANDLE Handle;
+	NTSTATUS Status = PsCreateSystemThreadEx(&Handle, 0, KERNEL_STACK_SIZE, 0, nullptr, FscLazyWriterThread, nullptr, FALSE, FALSE, PspSystemThreadStartup);
+
+	if (!NT_SUCCESS(Status)) {
+		return FALSE;
+	}
+
+	NtClose(Handle);
+
+	return TRUE;
+}
+
 VOID FscFlushPartitionElements(PFSCACHE_EXTENSION CacheExtension)
 {
 	// Acquire a lock to avoid somebody else changing the number of cache pages while we are trying to flush them
 	KeWaitForSingleObject(&FscUpdateNumOfPages, Executive, KernelMode, FALSE, nullptr);
 
+	// Write back the dirty pages of the partition first, so that they can be discarded below
+	FscWriteDirtyElements(CacheExtension);
+
 	KIRQL OldIrql = MiLock();
 
+Retry:
 	ULONG NumOfPagesToFlushLeft = 0;
-	PLIST_ENTRY Entry = FscCacheElementListHead.Blink;
-	while (Entry != &FscCacheElementListHead) {
-		PFSCACHE_ELEMENT Element = CONTAINING_RECORD(Entry, FSCACHE_ELEMENT, ListEntry);
-		if (Element->CacheExtension == CacheExtension) {
-			++NumOfPagesToFlushLeft;
+	for (PLIST_ENTRY ListHead : FscCacheElementLists) {
+		PLIST_ENTRY Entry = ListHead->Blink;
+		while (Entry != ListHead) {
+			PFSCACHE_ELEMENT Element = CONTAINING_RECORD(Entry, FSCACHE_ELEMENT, ListEntry);
+			Entry = Element->ListEntry.Blink;
+			if (Element->CacheExtension == CacheExtension) {
+				if ((Element->NumOfUsers == 0) && (Element->Dirty == 0)) {
+					FscInvalidateElement(Element);
+				}
+				else {
+					++NumOfPagesToFlushLeft;
+				}
+			}
 		}
+	}
 
-		if (Element->CacheExtension == nullptr) {
-			break;
+	if (NumOfPagesToFlushLeft) {
+		if (FscFindDirtyRun(CacheExtension)) {
+			MiUnlock(PASSIVE_LEVEL);
+			FscWriteDirtyElements(CacheExtension);
 		}
-
-		Entry = Element->ListEntry.Blink;
+		else {
+			FscWaitWithMiLockHeld(&FscReleasedPagesEvent, PASSIVE_LEVEL);
+		}
+		MiLock();
+		goto Retry;
 	}
 
-Retry:
-	Entry = FscCacheElementListHead.Blink;
-	while (Entry != &FscCacheElementListHead) {
-		PFSCACHE_ELEMENT Element = CONTAINING_RECORD(Entry, FSCACHE_ELEMENT, ListEntry);
-		if ((Element->CacheExtension == CacheExtension) && (Element->NumOfUsers == 0) && (Element->MarkForDeletion == 0)) {
-			--NumOfPagesToFlushLeft;
-			Element->MarkForDeletion = 1;
-			Element->CacheExtension = nullptr;
-			RemoveEntryList(&Element->ListEntry);
-		}
+	MiUnlock(OldIrql);
 
-		if (Element->CacheExtension == nullptr) {
-			break;
-		}
+	KeSetEvent(&FscUpdateNumOfPages, 0, FALSE);
+}
+
+VOID FscDiscardPartitionElements(PFSCACHE_EXTENSION CacheExtension)
+{
+	// Like FscFlushPartitionElements, but the dirty pages are dropped instead of written back, because their data is not wanted anymore. Pages that are in use
+	// or being written back by the lazy writer are waited for, so that nobody touches the partition after this returns
+
+	KeWaitForSingleObject(&FscUpdateNumOfPages, Executive, KernelMode, FALSE, nullptr);
 
-		Entry = Element->ListEntry.Blink;
+	KIRQL OldIrql = MiLock();
+
+Retry:
+	BOOLEAN PagesInUse = FALSE;
+	for (PLIST_ENTRY ListHead : FscCacheElementLists) {
+		PLIST_ENTRY Entry = ListHead->Blink;
+		while (Entry != ListHead) {
+			PFSCACHE_ELEMENT Element = CONTAINING_RECORD(Entry, FSCACHE_ELEMENT, ListEntry);
+			Entry = Element->ListEntry.Blink;
+			if (Element->CacheExtension == CacheExtension) {
+				if (Element->NumOfUsers == 0) {
+					if (Element->Dirty) {
+						Element->Dirty = 0;
+						--FscNumOfDirtyPages;
+						--FscGetStatistics(CacheExtension)->NumOfDirtyPages;
+					}
+					FscInvalidateElement(Element);
+				}
+				else {
+					PagesInUse = TRUE;
+				}
+			}
+		}
 	}
 
-	if (NumOfPagesToFlushLeft) {
-		MiUnlock(PASSIVE_LEVEL);
-		KeWaitForSingleObject(&FscReleasedPagesEvent, Executive, KernelMode, FALSE, nullptr);
+	if (PagesInUse) {
+		FscWaitWithMiLockHeld(&FscReleasedPagesEvent, PASSIVE_LEVEL);
 		MiLock();
 		goto Retry;
 	}
@@ -252,6 +838,38 @@ Retry:
 	KeSetEvent(&FscUpdateNumOfPages, 0, FALSE);
 }
 
+VOID FscWriteBackPartitionElements(PFSCACHE_EXTENSION CacheExtension)
+{
+	// Writes back the dirty pages of the partition, and waits for the ones that somebody else is writing back or using. Unlike FscFlushPartitionElements, the
+	// pages stay in the cache, so this can be called while other threads are reading from it
+
+	while (true) {
+		FscWriteDirtyElements(CacheExtension);
+
+		KIRQL OldIrql = MiLock();
+
+		BOOLEAN WriteBackPending = FALSE;
+		for (PLIST_ENTRY ListHead : FscCacheElementLists) {
+			PLIST_ENTRY Entry = ListHead->Flink;
+			while (Entry != ListHead) {
+				PFSCACHE_ELEMENT Element = CONTAINING_RECORD(Entry, FSCACHE_ELEMENT, ListEntry);
+				if ((Element->CacheExtension == CacheExtension) && (Element->Dirty || Element->WriteBack)) {
+					WriteBackPending = TRUE;
+					break;
+				}
+				Entry = Element->ListEntry.Flink;
+			}
+		}
+
+		if (WriteBackPending == FALSE) {
+			MiUnlock(OldIrql);
+			return;
+		}
+
+		FscWaitWithMiLockHeld(&FscReleasedPagesEvent, OldIrql);
+	}
+}
+
 NTSTATUS FscMapElementPage(PFSCACHE_EXTENSION CacheExtension, ULONGLONG ByteOffset, PVOID *ReturnedBuffer, BOOLEAN IsWrite)
 {
 	KIRQL OldIrql = MiLock();
@@ -260,57 +878,122 @@ Retry:
 	ULONG AlignedByteOffset = FscByteOffsetToAlignedOffset(ByteOffset);
 	PFSCACHE_ELEMENT Element = FscFindElement(CacheExtension, AlignedByteOffset);
 	if (Element) {
-		if (Element->WriteInProgress == 0) {
+		// Readers can share a page as long as nobody is writing to it, while a writer needs exclusive access. A reader also waits when the page already has
+		// as many users as NumOfUsers can count, since the counter would otherwise wrap around and the page would look idle
+		if ((Element->WriteInProgress == 0) && ((IsWrite == FALSE) || (Element->NumOfUsers == 0)) && (Element->NumOfUsers < FSC_MAX_USERS_PER_PAGE)) {
+			if (Element->ReadAhead) {
+				// First use of a page that was read ahead, so read-ahead is paying off for this partition and the window can grow
+				Element->ReadAhead = 0;
+				++FscGetStatistics(CacheExtension)->ReadAheadHits;
+				ULONG ReadAheadPages = FscGetReadAheadPages(CacheExtension) + 1;
+				CacheExtension->ReadAheadPages = ReadAheadPages > FSC_MAX_READ_AHEAD_PAGES ? FSC_MAX_READ_AHEAD_PAGES : ReadAheadPages;
+			}
 			++Element->NumOfUsers;
 			Element->WriteInProgress = IsWrite ? 1 : 0;
-			*ReturnedBuffer = PVOID((ULONG(Element->CacheBuffer) & ~PAGE_MASK) + BYTE_OFFSET(ByteOffset));
+			*ReturnedBuffer = PVOID((ULONG(Element->CacheBuffer) & ~PAGE_MASK) + (ULONG(ByteOffset) & FSC_BLOCK_MASK));
 			MiUnlock(OldIrql);
 
 			return STATUS_SUCCESS;
 		}
 
-		MiUnlock(OldIrql);
-		KeWaitForSingleObject(&FscConcurrentWriteEvent, Executive, KernelMode, FALSE, nullptr);
+		ULONGLONG WaitStartTime = KeQueryInterruptTime();
+		FscWaitWithMiLockHeld(FscGetElementGate(CacheExtension, AlignedByteOffset), OldIrql);
 		OldIrql = MiLock();
+		FscGetStatistics(CacheExtension)->WaitTime += (KeQueryInterruptTime() - WaitStartTime);
 
 		goto Retry;
 	}
 	else {
-		if (Element = FscAllocateFreeElement(); Element == nullptr) {
+		if (Element = FscAllocateFreeElement(TRUE); Element == nullptr) {
 			MiUnlock(OldIrql);
 			return STATUS_NO_MEMORY;
 		}
 
-		// Set NumOfUsers before releasing the Mm lock so that FscReduceCacheSize doesn't remove the element we are using
-		// Also set WriteInProgress so that FscMapElementPage doesn't attempt to use this element
-		Element->AlignedByteOffset = AlignedByteOffset;
-		Element->CacheExtension = CacheExtension;
-		Element->NumOfUsers = 1;
-		Element->WriteInProgress = 1;
+		// When this miss continues the previous one, also read ahead the following pages that are not cached yet. All pages are fetched with a single
+		// scatter request, because the cache pages are not contiguous
+		ULONG NumOfPages = 1;
+		FILE_SEGMENT_ELEMENT SegmentArray[FSC_MAX_TRANSFER_PAGES];
+		ULONG ReadAheadPages = AlignedByteOffset == CacheExtension->ReadAheadNextOffset ? FscGetReadAheadPages(CacheExtension) : 1;
+		ULONG LastAlignedByteOffset = (CacheExtension->PartitionLength.QuadPart != 0) ?
+			FscByteOffsetToAlignedOffset(CacheExtension->PartitionLength.QuadPart - 1) : AlignedByteOffset + ReadAheadPages - 1;
+
+		while (true) {
+			// Set NumOfUsers before releasing the Mm lock so that FscReduceCacheSize doesn't remove the element we are using
+			// Also set WriteInProgress so that FscMapElementPage doesn't attempt to use this element
+			Element->AlignedByteOffset = AlignedByteOffset + NumOfPages - 1;
+			Element->CacheExtension = CacheExtension;
+			Element->NumOfUsers = 1;
+			Element->WriteInProgress = 1;
+			Element->ReadAhead = 0;
+			FscInsertElementInHashTable(Element);
+			FscQueueNewElement(Element);
+			FscAddBlockToSegmentArray(SegmentArray, NumOfPages - 1, Element);
+
+			if ((NumOfPages == ReadAheadPages) || ((AlignedByteOffset + NumOfPages) > LastAlignedByteOffset) ||
+				FscLookupElement(CacheExtension, AlignedByteOffset + NumOfPages)) {
+				break;
+			}
+
+			if (Element = FscAllocateFreeElement(FALSE); Element == nullptr) {
+				break;
+			}
+
+			++NumOfPages;
+		}
+
+		CacheExtension->ReadAheadNextOffset = AlignedByteOffset + NumOfPages;
 
 		MiUnlock(OldIrql);
 
-		IoInfoBlock InfoBlock = SubmitIoRequestToHost(
-			IoRequestType::Read | DEV_TYPE(CacheExtension->DeviceType),
-			ByteOffset,
-			PAGE_SIZE,
-			ULONG(Element->CacheBuffer) & ~PAGE_MASK,
-			CacheExtension->HostHandle
-		);
+		IoInfoBlock InfoBlock;
+		if (NumOfPages == 1) {
+			InfoBlock = SubmitIoRequestToHost(
+				IoRequestType::Read | DEV_TYPE(CacheExtension->DeviceType),
+				ByteOffset & ~FSC_BLOCK_MASK,
+				FSC_BLOCK_SIZE,
+				ULONG(SegmentArray[0].Buffer),
+				CacheExtension->HostHandle
+			);
+		}
+		else {
+			InfoBlock = SubmitIoRequestToHost(
+				IoRequestType::ReadScatter | DEV_TYPE(CacheExtension->DeviceType),
+				ByteOffset & ~FSC_BLOCK_MASK,
+				NumOfPages << FSC_BLOCK_SHIFT,
+				ULONG(SegmentArray),
+				CacheExtension->HostHandle
+			);
+		}
 
 		OldIrql = MiLock();
 
+		// Find the elements again from their pages, because FscSetCacheSize might have moved them while the Mm lock was released
 		NTSTATUS Status = HostToNtStatus(InfoBlock.Status);
 		if (Status == STATUS_SUCCESS) {
-			Element->WriteInProgress = IsWrite ? 1 : 0;
-			*ReturnedBuffer = PVOID((ULONG(Element->CacheBuffer) & ~PAGE_MASK) + BYTE_OFFSET(ByteOffset));
+			FscGetStatistics(CacheExtension)->BytesReadFromHost += (NumOfPages << FSC_BLOCK_SHIFT);
 		}
-		else if (Status == STATUS_PENDING) {
-			// Should not happen right now, because RetrieveIoRequestFromHost is always synchronous
-			RIP_API_MSG("Asynchronous IO is not supported");
-		}
-		else {
-			Element->CacheBuffer = PCHAR(ULONG(Element->CacheBuffer) & ~PAGE_MASK);
+		for (ULONG Index = 0; Index < NumOfPages; ++Index) {
+			PVOID CacheBuffer = SegmentArray[Index * FSC_PAGES_PER_BLOCK].Buffer;
+			Element = FscFindElement(CacheBuffer);
+			if (Status == STATUS_SUCCESS) {
+				if (Index == 0) {
+					Element->WriteInProgress = IsWrite ? 1 : 0;
+					*ReturnedBuffer = PVOID(ULONG(CacheBuffer) + (ULONG(ByteOffset) & FSC_BLOCK_MASK));
+				}
+				else {
+					Element->NumOfUsers = 0;
+					Element->WriteInProgress = 0;
+					Element->ReadAhead = 1;
+				}
+				FscSignalReleasedElement(Element);
+			}
+			else {
+				// The page doesn't hold valid data, so make sure that nobody can find it. Wake up the threads that found it while it was being read first,
+				// they will miss it when they try again
+				Element->CacheBuffer = PCHAR(CacheBuffer);
+				FscSignalReleasedElement(Element);
+				FscInvalidateElement(Element);
+			}
 		}
 
 		MiUnlock(OldIrql);
@@ -323,28 +1006,62 @@ VOID FscUnmapElementPage(PVOID Buffer)
 {
 	KIRQL OldIrql = MiLock();
 
-	// NOTE: there can only be a single write happening at any given time, since other threads attempting new writes will block in FscMapElementPage
+	// NOTE: a writer has exclusive access to the page, since other threads attempting to map it will block in FscMapElementPage
 	PFSCACHE_ELEMENT Element = FscFindElement(Buffer);
+	BOOLEAN WasSaturated = Element->NumOfUsers == FSC_MAX_USERS_PER_PAGE;
 	--Element->NumOfUsers;
-	Element->WriteInProgress = 0;
-	if ((Element->NumOfUsers == 0) && (IsListEmpty(&FscReleasedPagesEvent.Header.WaitListHead) == FALSE)) {
-		KeSetEvent(&FscReleasedPagesEvent, 0, FALSE);
+	if (Element->WriteInProgress) {
+		// The page was mapped for writing, so the lazy writer will have to write it back to the host
+		Element->WriteInProgress = 0;
+		if (Element->Dirty == 0) {
+			Element->Dirty = 1;
+			++FscGetStatistics(Element->CacheExtension)->NumOfDirtyPages;
+			if (++FscNumOfDirtyPages == FSC_DIRTY_PAGES_THRESHOLD) {
+				KeSetEvent(&FscLazyWriterEvent, 0, FALSE);
+			}
+		}
+	}
+
+	// Readers only block writers and the readers that found the page with the maximum number of users, so there's nobody else to wake up until the last
+	// user is gone
+	if ((Element->NumOfUsers == 0) || WasSaturated) {
+		FscSignalReleasedElement(Element);
 	}
-	KeSetEvent(&FscConcurrentWriteEvent, 0, FALSE);
-	FscConcurrentWriteEvent.Header.SignalState = 0;
 
 	MiUnlock(OldIrql);
 }
 
 EXPORTNUM(35) ULONG XBOXAPI FscGetCacheSize()
 {
-	return FscCurrNumberOfCachePages;
+	return FscCurrNumberOfCachePages * FSC_PAGES_PER_BLOCK;
 }
 
-EXPORTNUM(37) NTSTATUS XBOXAPI FscSetCacheSize
-(
-	ULONG NumberOfCachePages
-)
+EXPORTNUM(36) VOID XBOXAPI FscInvalidateIdleBlocks()
+{
+	// Drops all clean pages that nobody is using. Their elements are moved to the free list one by one, so the lists don't need to be rebuilt, and
+	// the number of cache pages doesn't change
+	KIRQL OldIrql = MiLock();
+
+	for (PLIST_ENTRY ListHead : FscCacheElementLists) {
+		if (ListHead == &FscFreeElementListHead) {
+			continue;
+		}
+
+		PLIST_ENTRY Entry = ListHead->Flink;
+		while (Entry != ListHead) {
+			PFSCACHE_ELEMENT Element = CONTAINING_RECORD(Entry, FSCACHE_ELEMENT, ListEntry);
+			Entry = Element->ListEntry.Flink;
+			if ((Element->NumOfUsers == 0) && (Element->MarkForDeletion == 0) && (Element->Dirty == 0)) {
+				Element->ReadAhead = 0;
+				FscInvalidateElement(Element);
+			}
+		}
+	}
+
+	MiUnlock(OldIrql);
+}
+
+static NTSTATUS FscResizeCache(ULONG NumberOfCachePages)
 {
 	KeWaitForSingleObject(&FscUpdateNumOfPages, Executive, KernelMode, FALSE, nullptr);
 
@@ -358,7 +1075,7 @@ EXPORTNUM(37) NTSTATUS XBOXAPI FscSetCacheSize
 		Status = FscIncreaseCacheSize(NumberOfCachePages);
 	}
 	else if (NumberOfCachePages < FscCurrNumberOfCachePages) {
-		Status = FscReduceCacheSize(NumberOfCachePages);
+		Status = FscReduceCacheSize(NumberOfCachePages, TRUE);
 	}
 
 	MiUnlock(OldIrql);
@@ -367,3 +1084,74 @@ EXPORTNUM(37) NTSTATUS XBOXAPI FscSetCacheSize
 
 	return Status;
 }
+
+EXPORTNUM(37) NTSTATUS XBOXAPI FscSetCacheSize
+(
+	ULONG NumberOfCachePages
+)
+{
+	// The caller counts memory pages, which are rounded up to whole blocks
+	return FscResizeCache((NumberOfCachePages + FSC_PAGES_PER_BLOCK - 1) / FSC_PAGES_PER_BLOCK);
+}
+
+NTSTATUS FscQueryStatistics(ULONG PartitionNumber, PFSCACHE_STATISTICS Statistics)
+{
+	if (PartitionNumber >= FSC_NUM_OF_PARTITIONS) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	KIRQL OldIrql = MiLock();
+	*Statistics = FscPartitionStatistics[PartitionNumber];
+	MiUnlock(OldIrql);
+
+	return STATUS_SUCCESS;
+}
+
+VOID FscDumpStatistics()
+{
+	DbgPrint("Fsc: %u cache pages of %u KiB, %u dirty pages, %u free memory pages in the system", FscCurrNumberOfCachePages, FSC_BLOCK_SIZE >> 10,
+		FscNumOfDirtyPages, MiTotalPagesAvailable);
+
+	for (ULONG PartitionNumber = 0; PartitionNumber < FSC_NUM_OF_PARTITIONS; ++PartitionNumber) {
+		FSCACHE_STATISTICS Statistics;
+		FscQueryStatistics(PartitionNumber, &Statistics);
+		if ((Statistics.Hits == 0) && (Statistics.Misses == 0)) {
+			continue; // partition never used the cache
+		}
+
+		DbgPrint("Fsc: partition%u -> %u hits, %u misses, %u evictions, %u read-ahead hits, %llu bytes read from host, %llu ms waited on busy pages, %u dirty pages",
+			PartitionNumber, Statistics.Hits, Statistics.Misses, Statistics.Evictions, Statistics.ReadAheadHits, Statistics.BytesReadFromHost,
+			Statistics.WaitTime / 10000, Statistics.NumOfDirtyPages);
+	}
+}
+
+ULONG FscTrimCache(ULONG NumberOfPages)
+{
+	// NOTE: this is called by the memory manager when an allocation runs short of pages, possibly with the lock of the memory manager held and at
+	// DISPATCH_LEVEL, so it must never block. Only the pages that are clean and idle right now are given back, and nothing is done if another
+	// thread is already resizing the cache
+	LARGE_INTEGER Timeout{ .QuadPart = 0 };
+	if (KeWaitForSingleObject(&FscUpdateNumOfPages, Executive, KernelMode, FALSE, &Timeout) != STATUS_SUCCESS) {
+		return 0;
+	}
+
+	KIRQL OldIrql = MiLock();
+
+	// NumberOfPages counts memory pages, convert it to cache pages
+	NumberOfPages = (NumberOfPages + FSC_PAGES_PER_BLOCK - 1) / FSC_PAGES_PER_BLOCK;
+	ULONG OldNumberOfCachePages = FscCurrNumberOfCachePages;
+	if (OldNumberOfCachePages) {
+		// Trim a few more pages than needed, so that a series of small allocations doesn't have to come back here every time
+		if (NumberOfPages < FSC_MIN_PAGES_TO_TRIM) {
+			NumberOfPages = FSC_MIN_PAGES_TO_TRIM;
+		}
+		FscReduceCacheSize(NumberOfPages < OldNumberOfCachePages ? OldNumberOfCachePages - NumberOfPages : 0, FALSE);
+	}
+	ULONG NumberOfTrimmedPages = (OldNumberOfCachePages - FscCurrNumberOfCachePages) * FSC_PAGES_PER_BLOCK;
+
+	MiUnlock(OldIrql);
+
+	KeSetEvent(&FscUpdateNumOfPages, 0, FALSE);
+
+	return NumberOfTrimmedPages;
+}
@@ -7,6 +7,25 @@
 #include "mi.hpp"
 #include "hdd\fatx.hpp"
 
+// Size of the blocks of the cache. Larger blocks allow a bigger cache with the same number of elements, and need fewer host requests per MiB
+#ifndef FSC_BLOCK_SIZE_KIB
+#define FSC_BLOCK_SIZE_KIB 4
+#endif
+
+#if FSC_BLOCK_SIZE_KIB == 4
+#define FSC_BLOCK_SHIFT 12
+#elif FSC_BLOCK_SIZE_KIB == 16
+#define FSC_BLOCK_SHIFT 14
+#elif FSC_BLOCK_SIZE_KIB == 64
+#define FSC_BLOCK_SHIFT 16
+#else
+#error "Unsupported block size for the file system cache"
+#endif
+
+#define FSC_BLOCK_SIZE (1 << FSC_BLOCK_SHIFT)
+#define FSC_BLOCK_MASK (FSC_BLOCK_SIZE - 1)
+#define FSC_PAGES_PER_BLOCK (FSC_BLOCK_SIZE >> PAGE_SHIFT)
+
 
 struct FSCACHE_ELEMENT {
 	ULONG AlignedByteOffset;
@@ -21,10 +40,31 @@ struct FSCACHE_ELEMENT {
 		};
 		PCHAR CacheBuffer;
 	};
+	// NOTE: these are kept out of the word above, so that NumOfUsers keeps all its bits now that a page can have many readers
+	union {
+		struct {
+			ULONG WriteBack : 1; // the page is being written back to the host
+			ULONG ReadAhead : 1;
+			ULONG Dirty : 1;
+			ULONG InA1 : 1; // only used by the 2Q replacement policy
+		};
+		ULONG Flags;
+	};
 	LIST_ENTRY ListEntry;
 };
 using PFSCACHE_ELEMENT = FSCACHE_ELEMENT *;
 
+struct FSCACHE_STATISTICS {
+	ULONG Hits;
+	ULONG Misses;
+	ULONG Evictions; // valid pages that were discarded to make room for other ones
+	ULONG ReadAheadHits; // pages that were read ahead and later used
+	ULONGLONG BytesReadFromHost;
+	ULONGLONG WaitTime; // time spent waiting for pages used by other threads, in 100 ns units
+	ULONG NumOfDirtyPages;
+};
+using PFSCACHE_STATISTICS = FSCACHE_STATISTICS *;
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -32,6 +72,8 @@ extern "C" {
 
 EXPORTNUM(35) DLLEXPORT ULONG XBOXAPI FscGetCacheSize();
 
+EXPORTNUM(36) DLLEXPORT VOID XBOXAPI FscInvalidateIdleBlocks();
+
 EXPORTNUM(37) DLLEXPORT NTSTATUS XBOXAPI FscSetCacheSize
 (
 	ULONG NumberOfCachePages
@@ -43,7 +85,14 @@ EXPORTNUM(37) DLLEXPORT NTSTATUS XBOXAPI FscSetCacheSize
 
 
 inline ULONG FscCurrNumberOfCachePages = 0;
+inline ULONG FscNumOfDirtyPages = 0;
 
+BOOLEAN FscInitSystem();
+ULONG FscTrimCache(ULONG NumberOfPages);
+NTSTATUS FscQueryStatistics(ULONG PartitionNumber, PFSCACHE_STATISTICS Statistics);
+VOID FscDumpStatistics();
 NTSTATUS FscMapElementPage(PFSCACHE_EXTENSION CacheExtension, ULONGLONG ByteOffset, PVOID *ReturnedBuffer, BOOLEAN IsWrite);
 VOID FscUnmapElementPage(PVOID Buffer);
 VOID FscFlushPartitionElements(PFSCACHE_EXTENSION CacheExtension);
+VOID FscWriteBackPartitionElements(PFSCACHE_EXTENSION CacheExtension);
+VOID FscDiscardPartitionElements(PFSCACHE_EXTENSION CacheExtension);
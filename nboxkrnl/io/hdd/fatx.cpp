@@ -19,6 +19,10 @@
 #define FATX_DIRECTORY_FILE             FILE_DIRECTORY_FILE // = 0x00000001
 #define FATX_DELETE_ON_CLOSE            FILE_DELETE_ON_CLOSE // = 0x00001000
 #define FATX_VOLUME_FILE                0x80000000
+#define FATX_CACHED_FILE                0x40000000 // some pages of the file might be in the file system cache
+#define FATX_DIRTY_CACHED_FILE          0x20000000 // some pages of the file in the file system cache might not be written back yet
+
+#define FATX_MAX_CACHED_TRANSFER_LENGTH PAGE_SIZE
 
 #pragma pack(1)
 struct FATX_SUPERBLOCK {
@@ -91,6 +95,43 @@ static NTSTATUS FatxCompleteRequest(PIRP Irp, NTSTATUS Status, PFAT_VOLUME_EXTEN
 	return Status;
 }
 
+static VOID XBOXAPI FatxCompleteAsyncRead(IoInfoBlock InfoBlock, PVOID Context)
+{
+	// Called at DISPATCH_LEVEL from the IDE dpc, so the volume lock cannot be taken here. This is ok because the irp references the file object, which keeps its FileInfo alive
+
+	PIRP Irp = (PIRP)Context;
+	NTSTATUS Status = HostToNtStatus(InfoBlock.Status);
+	if (NT_SUCCESS(Status)) {
+		PFATX_FILE_INFO FileInfo = (PFATX_FILE_INFO)IoGetCurrentIrpStackLocation(Irp)->FileObject->FsContext2;
+		LARGE_INTEGER LastAccessTime;
+		KeQuerySystemTime(&LastAccessTime);
+		atomic_store64(&FileInfo->LastAccessTime.QuadPart, LastAccessTime.QuadPart);
+	}
+
+	Irp->IoStatus.Information = InfoBlock.Info;
+	Irp->IoStatus.Status = Status;
+	IofCompleteRequest(Irp, PRIORITY_BOOST_IO);
+}
+
+static VOID XBOXAPI FatxCompleteAsyncWrite(IoInfoBlock InfoBlock, PVOID Context)
+{
+	// NOTE: only writes that don't extend the file are done asynchronously, so FileSize doesn't need to be updated here
+
+	PIRP Irp = (PIRP)Context;
+	NTSTATUS Status = HostToNtStatus(InfoBlock.Status);
+	if (NT_SUCCESS(Status)) {
+		PFATX_FILE_INFO FileInfo = (PFATX_FILE_INFO)IoGetCurrentIrpStackLocation(Irp)->FileObject->FsContext2;
+		LARGE_INTEGER CurrentTime;
+		KeQuerySystemTime(&CurrentTime);
+		atomic_store64(&FileInfo->LastAccessTime.QuadPart, CurrentTime.QuadPart);
+		atomic_store64(&FileInfo->LastWriteTime.QuadPart, CurrentTime.QuadPart);
+	}
+
+	Irp->IoStatus.Information = InfoBlock.Info;
+	Irp->IoStatus.Status = Status;
+	IofCompleteRequest(Irp, PRIORITY_BOOST_IO);
+}
+
 static BOOLEAN FatxIsNameValid(POBJECT_STRING Name)
 {
 	if ((Name->Length == 0) || (Name->Length > FATX_MAX_FILE_NAME_LENGTH)) { // cannot be empty or exceed 42 chars
@@ -158,12 +199,69 @@ static VOID FatxRemoveFile(PFAT_VOLUME_EXTENSION VolumeExtension, PFATX_FILE_INF
 	RemoveEntryList(&FileInfo->ListEntry);
 }
 
+static BOOLEAN FatxIsCachedTransfer(PFILE_OBJECT FileObject, PIRP Irp, PFATX_FILE_INFO FileInfo, ULONG Length)
+{
+	// Small buffered transfers go through the file system cache, so that titles that repeatedly read and write a few bytes of their config and save files
+	// don't need to go to the host every time. Everything else, including large unaligned transfers, is forwarded to the host with the buffer of the caller in
+	// a single request
+	if ((FileObject->Flags & FO_NO_INTERMEDIATE_BUFFERING) || (Irp->Flags & IRP_SCATTER_GATHER_OPERATION) || (FileInfo->Flags & FATX_VOLUME_FILE)) {
+		return FALSE;
+	}
+
+	return Length <= FATX_MAX_CACHED_TRANSFER_LENGTH;
+}
+
+static NTSTATUS FatxCachedTransfer(PFATX_FILE_INFO FileInfo, ULONG FileOffset, ULONG Length, PCHAR Buffer, BOOLEAN IsWrite)
+{
+	// NOTE: the caller must make sure that the transfer doesn't go past the end of the file, because the cache doesn't extend it
+
+	// NOTE: readers only hold the shared volume lock, so the flags must be updated atomically
+	atomic_or32(&FileInfo->Flags, IsWrite ? (FATX_CACHED_FILE | FATX_DIRTY_CACHED_FILE) : FATX_CACHED_FILE);
+	while (Length) {
+		PCHAR CacheBuffer;
+		if (NTSTATUS Status = FscMapElementPage(&FileInfo->CacheExtension, FileOffset, (PVOID *)&CacheBuffer, IsWrite); !NT_SUCCESS(Status)) {
+			return Status;
+		}
+
+		ULONG BytesToCopy = FSC_BLOCK_SIZE - (FileOffset & FSC_BLOCK_MASK);
+		if (BytesToCopy > Length) {
+			BytesToCopy = Length;
+		}
+
+		if (IsWrite) {
+			memcpy(CacheBuffer, Buffer, BytesToCopy);
+		}
+		else {
+			memcpy(Buffer, CacheBuffer, BytesToCopy);
+		}
+		FscUnmapElementPage(CacheBuffer);
+
+		FileOffset += BytesToCopy;
+		Buffer += BytesToCopy;
+		Length -= BytesToCopy;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+static VOID FatxFlushFileCache(PFATX_FILE_INFO FileInfo)
+{
+	// Writes back and discards the cached pages of the file. This must be done before the host file is written directly or its size changes, otherwise the
+	// cache would hold stale data. The caller must hold the exclusive volume lock
+
+	if (FileInfo->Flags & FATX_CACHED_FILE) {
+		FscFlushPartitionElements(&FileInfo->CacheExtension);
+		FileInfo->Flags &= ~(FATX_CACHED_FILE | FATX_DIRTY_CACHED_FILE);
+	}
+}
+
 static NTSTATUS FatxSetupVolumeExtension(PFAT_VOLUME_EXTENSION VolumeExtension, PPARTITION_INFORMATION PartitionInformation)
 {
 	PFATX_SUPERBLOCK Superblock;
 	ULONGLONG HostHandle = PARTITION0_HANDLE + PartitionInformation->PartitionNumber;
 	VolumeExtension->CacheExtension.HostHandle = HostHandle;
 	VolumeExtension->CacheExtension.DeviceType = DEV_PARTITION0 + PartitionInformation->PartitionNumber;
+	VolumeExtension->CacheExtension.PartitionLength = PartitionInformation->PartitionLength;
 	if (NTSTATUS Status = FscMapElementPage(&VolumeExtension->CacheExtension, 0, (PVOID *)&Superblock, FALSE); !NT_SUCCESS(Status)) {
 		return Status;
 	}
@@ -521,6 +619,10 @@ static NTSTATUS XBOXAPI FatxIrpCreate(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 			}
 		}
 		++FileInfo->RefCounter;
+		if ((Disposition == FILE_SUPERSEDE) || (Disposition == FILE_OVERWRITE) || (Disposition == FILE_OVERWRITE_IF)) {
+			// The host might truncate the file, so the cached pages of the file can't be used anymore
+			FatxFlushFileCache(FileInfo);
+		}
 	}
 	else {
 		FileInfo = (PFATX_FILE_INFO)ExAllocatePool(sizeof(FATX_FILE_INFO));
@@ -533,6 +635,11 @@ static NTSTATUS XBOXAPI FatxIrpCreate(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 		FileInfo->FileSize = HasBackslashAtEnd ? 0 : InitialSize;
 		FileInfo->Flags = CreateOptions & (FILE_DELETE_ON_CLOSE | FILE_DIRECTORY_FILE);
 		FileInfo->RefCounter = 1;
+		FileInfo->CacheExtension = VolumeExtension->CacheExtension;
+		FileInfo->CacheExtension.HostHandle = FileInfo->HostHandle;
+		FileInfo->CacheExtension.PartitionLength.QuadPart = FileInfo->FileSize;
+		FileInfo->CacheExtension.ReadAheadNextOffset = 0;
+		FileInfo->CacheExtension.ReadAheadPages = 0;
 		strncpy(FileInfo->FileName, FileName.Buffer, FileName.Length);
 		FatxInsertFile(VolumeExtension, FileInfo);
 		IoSetShareAccess(DesiredAccess, ShareAccess, FileObject, &FileInfo->ShareAccess);
@@ -583,6 +690,7 @@ static NTSTATUS XBOXAPI FatxIrpCreate(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 		if (!HasBackslashAtEnd && FileInfoCreated && (InfoBlock.Info == Opened)) {
 			// Only update the file size if it was opened for the first time ever
 			FileInfo->FileSize = ULONG(InfoBlock.Info2OrId);
+			FileInfo->CacheExtension.PartitionLength.QuadPart = FileInfo->FileSize;
 		}
 		if (!FileInfoCreated && ((InfoBlock.Info == Overwritten) || (InfoBlock.Info == Superseded))) {
 			LARGE_INTEGER CurrentTime;
@@ -612,6 +720,7 @@ static NTSTATUS XBOXAPI FatxIrpClose(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 			FatxRemoveFile(VolumeExtension, FileInfo);
 		}
 		else {
+			FatxFlushFileCache(FileInfo);
 			SubmitIoRequestToHost(
 				DEV_TYPE(VolumeExtension->CacheExtension.DeviceType) | IoRequestType::Close,
 				0,
@@ -698,23 +807,64 @@ static NTSTATUS XBOXAPI FatxIrpRead(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 		}
 	}
 
-	IoInfoBlock InfoBlock = SubmitIoRequestToHost(
-		DEV_TYPE(VolumeExtension->CacheExtension.DeviceType) | IoRequestType::Read,
-		FileOffset.LowPart,
-		Length,
-		(ULONG_PTR)Buffer,
-		FileInfo->HostHandle
-	);
+	NTSTATUS Status;
+	ULONG BytesRead;
+	if (FatxIsCachedTransfer(FileObject, Irp, FileInfo, Length)) {
+		// Served from the file system cache, so the request always completes synchronously
+		Status = FatxCachedTransfer(FileInfo, FileOffset.LowPart, Length, (PCHAR)Buffer, FALSE);
+		BytesRead = NT_SUCCESS(Status) ? Length : 0;
+	}
+	else {
+		if (FileInfo->Flags & FATX_DIRTY_CACHED_FILE) {
+			// The host file is read directly, so write back the data that is still only in the cache first. The pages are not discarded, since other readers
+			// might be using them. Writers hold the exclusive volume lock, so no page of the file can become dirty again before the flag is cleared
+			FscWriteBackPartitionElements(&FileInfo->CacheExtension);
+			atomic_and32(&FileInfo->Flags, ~FATX_DIRTY_CACHED_FILE);
+		}
 
-	NTSTATUS Status = HostToNtStatus(InfoBlock.Status);
-	if (Status == STATUS_PENDING) {
-		// Should not happen right now, because RetrieveIoRequestFromHost is always synchronous
-		RIP_API_MSG("Asynchronous IO is not supported");
+		IopMakeTransferResident(Irp, Buffer, Length);
+
+		ULONG RequestType = IoRequestType::Read;
+		if (Irp->Flags & IRP_SCATTER_GATHER_OPERATION) {
+			// The host transfers one page for each element of the segment array
+			RequestType = IoRequestType::ReadScatter;
+			Buffer = Irp->SegmentArray;
+		}
+
+		if (!(FileObject->Flags & FO_SYNCHRONOUS_IO)) {
+			// Mark the irp as pending before submitting it, because the dpc can complete it before SubmitIoRequestToHostAsync returns
+			IoMarkIrpPending(Irp);
+			if (SubmitIoRequestToHostAsync(
+				DEV_TYPE(VolumeExtension->CacheExtension.DeviceType) | RequestType,
+				FileOffset.LowPart,
+				Length,
+				(ULONG_PTR)Buffer,
+				FileInfo->HostHandle,
+				FatxCompleteAsyncRead,
+				Irp)) {
+				FatxVolumeUnlock(VolumeExtension);
+				return STATUS_PENDING;
+			}
+			// The host cannot complete the request asynchronously, so fall back to a synchronous request
+			IrpStackPointer->Control &= ~SL_PENDING_RETURNED;
+		}
+
+		IoInfoBlock InfoBlock = SubmitIoRequestToHost(
+			DEV_TYPE(VolumeExtension->CacheExtension.DeviceType) | RequestType,
+			FileOffset.LowPart,
+			Length,
+			(ULONG_PTR)Buffer,
+			FileInfo->HostHandle
+		);
+
+		Status = HostToNtStatus(InfoBlock.Status);
+		BytesRead = InfoBlock.Info;
 	}
-	else if (NT_SUCCESS(Status)) {
+
+	if (NT_SUCCESS(Status)) {
 		if (FileObject->Flags & FO_SYNCHRONOUS_IO) {
 			// NOTE: despite the addition not being atomic, this is ok because on fatx the file size limit is 4 GiB, which means the high dword will always be zero with no carry to add to it
-			FileObject->CurrentByteOffset.QuadPart += InfoBlock.Info;
+			FileObject->CurrentByteOffset.QuadPart += BytesRead;
 		}
 		// NOTE: FileInfo->LastAccessTime must be updated atomically because FatxIrpRead acquires a shared lock, which means it can be concurrently updated
 		LARGE_INTEGER LastAccessTime;
@@ -722,7 +872,7 @@ static NTSTATUS XBOXAPI FatxIrpRead(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 		atomic_store64(&FileInfo->LastAccessTime.QuadPart, LastAccessTime.QuadPart);
 	}
 
-	Irp->IoStatus.Information = InfoBlock.Info;
+	Irp->IoStatus.Information = BytesRead;
 	return FatxCompleteRequest(Irp, Status, VolumeExtension);
 }
 
@@ -784,25 +934,63 @@ static NTSTATUS XBOXAPI FatxIrpWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 		}
 	}
 
-	IoInfoBlock InfoBlock = SubmitIoRequestToHost(
-		DEV_TYPE(VolumeExtension->CacheExtension.DeviceType) | IoRequestType::Write,
-		FileOffset.LowPart,
-		Length,
-		(ULONG_PTR)Buffer,
-		FileInfo->HostHandle
-	);
+	NTSTATUS Status;
+	ULONG BytesWritten;
+	if (((FileOffset.LowPart + Length) <= FileInfo->FileSize) &&
+		FatxIsCachedTransfer(FileObject, Irp, FileInfo, Length)) {
+		// Only writes that don't extend the file are cached, the lazy writer will write them back to the host later
+		Status = FatxCachedTransfer(FileInfo, FileOffset.LowPart, Length, (PCHAR)Buffer, TRUE);
+		BytesWritten = NT_SUCCESS(Status) ? Length : 0;
+	}
+	else {
+		FatxFlushFileCache(FileInfo);
+		IopMakeTransferResident(Irp, Buffer, Length);
+
+		ULONG RequestType = IoRequestType::Write;
+		if (Irp->Flags & IRP_SCATTER_GATHER_OPERATION) {
+			// The host transfers one page for each element of the segment array
+			RequestType = IoRequestType::WriteGather;
+			Buffer = Irp->SegmentArray;
+		}
 
-	NTSTATUS Status = HostToNtStatus(InfoBlock.Status);
-	if (Status == STATUS_PENDING) {
-		// Should not happen right now, because RetrieveIoRequestFromHost is always synchronous
-		RIP_API_MSG("Asynchronous IO is not supported");
+		// Writes that extend the file are always synchronous, so that FileSize is only updated while we hold the exclusive volume lock
+		if (!(FileObject->Flags & FO_SYNCHRONOUS_IO) && ((FileOffset.LowPart + Length) <= FileInfo->FileSize)) {
+			// Mark the irp as pending before submitting it, because the dpc can complete it before SubmitIoRequestToHostAsync returns
+			IoMarkIrpPending(Irp);
+			if (SubmitIoRequestToHostAsync(
+				DEV_TYPE(VolumeExtension->CacheExtension.DeviceType) | RequestType,
+				FileOffset.LowPart,
+				Length,
+				(ULONG_PTR)Buffer,
+				FileInfo->HostHandle,
+				FatxCompleteAsyncWrite,
+				Irp)) {
+				FatxVolumeUnlock(VolumeExtension);
+				return STATUS_PENDING;
+			}
+			// The host cannot complete the request asynchronously, so fall back to a synchronous request
+			IrpStackPointer->Control &= ~SL_PENDING_RETURNED;
+		}
+
+		IoInfoBlock InfoBlock = SubmitIoRequestToHost(
+			DEV_TYPE(VolumeExtension->CacheExtension.DeviceType) | RequestType,
+			FileOffset.LowPart,
+			Length,
+			(ULONG_PTR)Buffer,
+			FileInfo->HostHandle
+		);
+
+		Status = HostToNtStatus(InfoBlock.Status);
+		BytesWritten = InfoBlock.Info;
 	}
-	else if (NT_SUCCESS(Status)) {
-		if ((FileObject->CurrentByteOffset.LowPart + InfoBlock.Info) > FileInfo->FileSize) {
-			FileInfo->FileSize = FileObject->CurrentByteOffset.LowPart + InfoBlock.Info;
+
+	if (NT_SUCCESS(Status)) {
+		if ((FileOffset.LowPart + BytesWritten) > FileInfo->FileSize) {
+			FileInfo->FileSize = FileOffset.LowPart + BytesWritten;
+			FileInfo->CacheExtension.PartitionLength.QuadPart = FileInfo->FileSize;
 		}
 		if (FileObject->Flags & FO_SYNCHRONOUS_IO) {
-			FileObject->CurrentByteOffset.QuadPart += InfoBlock.Info;
+			FileObject->CurrentByteOffset.QuadPart += BytesWritten;
 		}
 		LARGE_INTEGER CurrentTime;
 		KeQuerySystemTime(&CurrentTime);
@@ -810,7 +998,7 @@ static NTSTATUS XBOXAPI FatxIrpWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 		FileInfo->LastWriteTime = CurrentTime;
 	}
 
-	Irp->IoStatus.Information = InfoBlock.Info;
+	Irp->IoStatus.Information = BytesWritten;
 	return FatxCompleteRequest(Irp, Status, VolumeExtension);
 }
 
@@ -994,6 +1182,12 @@ static NTSTATUS XBOXAPI FatxIrpCleanup(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 	IoRemoveShareAccess(FileObject, &FileInfo->ShareAccess);
 
 	if (!(VolumeExtension->Flags & FATX_VOLUME_DISMOUNTED) && (FileInfo->ShareAccess.OpenCount == 0) && (FileInfo->Flags & FATX_DELETE_ON_CLOSE)) {
+		// The file is going away, so drop its cached pages without writing back the dirty ones. This also makes sure that the lazy writer doesn't write to
+		// the file after the host has removed it
+		if (FileInfo->Flags & FATX_CACHED_FILE) {
+			FscDiscardPartitionElements(&FileInfo->CacheExtension);
+			FileInfo->Flags &= ~(FATX_CACHED_FILE | FATX_DIRTY_CACHED_FILE);
+		}
 		IoInfoBlock InfoBlock = SubmitIoRequestToHost(
 			DEV_TYPE(VolumeExtension->CacheExtension.DeviceType) | IoRequestType::Remove,
 			0,
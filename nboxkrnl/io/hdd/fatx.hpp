@@ -11,6 +11,17 @@
 #define FATX_MAX_FILE_NAME_LENGTH 42
 
 
+struct FSCACHE_EXTENSION {
+	PDEVICE_OBJECT TargetDeviceObject;
+	LARGE_INTEGER PartitionLength; // for the cache extension of a file, this is the file size instead
+	ULONG SectorSize;
+	ULONG DeviceType;
+	ULONGLONG HostHandle;
+	ULONG ReadAheadNextOffset; // page right after the last run read from the host, a miss there means that the partition is being read sequentially
+	ULONG ReadAheadPages; // current read-ahead window, adjusted by how many of the previously read-ahead pages were actually used
+};
+using PFSCACHE_EXTENSION = FSCACHE_EXTENSION *;
+
 struct FATX_FILE_INFO {
 	UCHAR FileNameLength;
 	CHAR FileName[FATX_MAX_FILE_NAME_LENGTH];
@@ -23,18 +34,10 @@ struct FATX_FILE_INFO {
 	LARGE_INTEGER LastWriteTime;
 	ULONG RefCounter;
 	LIST_ENTRY ListEntry;
+	FSCACHE_EXTENSION CacheExtension; // used by the small buffered transfers on the file, which go through the file system cache
 };
 using PFATX_FILE_INFO = FATX_FILE_INFO *;
 
-struct FSCACHE_EXTENSION {
-	PDEVICE_OBJECT TargetDeviceObject;
-	LARGE_INTEGER PartitionLength;
-	ULONG SectorSize;
-	ULONG DeviceType;
-	ULONGLONG HostHandle;
-};
-using PFSCACHE_EXTENSION = FSCACHE_EXTENSION *;
-
 struct FAT_VOLUME_EXTENSION {
 	FSCACHE_EXTENSION CacheExtension;
 	FATX_FILE_INFO VolumeInfo;
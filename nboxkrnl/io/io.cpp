@@ -10,9 +10,20 @@
 #include "halp.hpp"
 #include "cdrom\cdrom.hpp"
 #include "hdd\hdd.hpp"
+#include "fsc.hpp"
 #include <string.h>
 
 
+EXPORTNUM(64) OBJECT_TYPE IoCompletionObjectType = {
+	ExAllocatePoolWithTag,
+	ExFreePool,
+	nullptr,
+	IopDeleteIoCompletion,
+	nullptr,
+	(PVOID)offsetof(KQUEUE, Header),
+	'pmoC'
+};
+
 EXPORTNUM(70) OBJECT_TYPE IoDeviceObjectType = {
 	ExAllocatePoolWithTag,
 	ExFreePool,
@@ -44,6 +55,10 @@ BOOLEAN IoInitSystem()
 	XboxFactoryGameRegion = CachedEeprom.EncryptedSettings.GameRegion;
 	IoDvdInputType = inl(DVD_MEDIA_TYPE);
 
+	if (!FscInitSystem()) {
+		return FALSE;
+	}
+
 	if (!HddInitDriver()) {
 		return FALSE;
 	}
@@ -618,6 +633,30 @@ EXPORTNUM(78) VOID XBOXAPI IoRemoveShareAccess
 	}
 }
 
+EXPORTNUM(79) NTSTATUS XBOXAPI IoSetIoCompletion
+(
+	PVOID IoCompletion,
+	PVOID KeyContext,
+	PVOID ApcContext,
+	NTSTATUS IoStatus,
+	ULONG_PTR IoStatusInformation
+)
+{
+	PIO_MINI_COMPLETION_PACKET MiniPacket = (PIO_MINI_COMPLETION_PACKET)ExAllocatePoolWithTag(sizeof(IO_MINI_COMPLETION_PACKET), 'pcoI');
+	if (MiniPacket == nullptr) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	MiniPacket->PacketType = IopCompletionPacketMini;
+	MiniPacket->KeyContext = KeyContext;
+	MiniPacket->ApcContext = ApcContext;
+	MiniPacket->IoStatus = IoStatus;
+	MiniPacket->IoStatusInformation = IoStatusInformation;
+	KeInsertQueue((PKQUEUE)IoCompletion, &MiniPacket->ListEntry);
+
+	return STATUS_SUCCESS;
+}
+
 EXPORTNUM(80) VOID XBOXAPI IoSetShareAccess
 (
 	ULONG DesiredAccess,
@@ -732,8 +771,9 @@ EXPORTNUM(87) VOID FASTCALL IofCompleteRequest
 	if (Irp->Flags & IRP_UNLOCK_USER_BUFFER) {
 		RIP_API_MSG("IRP_UNLOCK_USER_BUFFER not implemented");
 	}
-	else if (Irp->SegmentArray) {
-		RIP_API_MSG("Irp->SegmentArray not implemented");
+	else if (Irp->Flags & IRP_UNMAP_SEGMENT_ARRAY) {
+		// NOTE: the host accesses the segments of a scatter/gather request with their virtual addresses, so we never map them
+		RIP_API_MSG("IRP_UNMAP_SEGMENT_ARRAY not implemented");
 	}
 
 	if (Irp->Flags & IRP_DEFER_IO_COMPLETION && !Irp->PendingReturned) {
@@ -131,6 +131,8 @@ EXPORTNUM(63) DLLEXPORT NTSTATUS XBOXAPI IoCheckShareAccess
 	BOOLEAN Update
 );
 
+EXPORTNUM(64) DLLEXPORT extern OBJECT_TYPE IoCompletionObjectType;
+
 EXPORTNUM(65) DLLEXPORT NTSTATUS XBOXAPI IoCreateDevice
 (
 	PDRIVER_OBJECT DriverObject,
@@ -194,6 +196,15 @@ EXPORTNUM(78) DLLEXPORT VOID XBOXAPI IoRemoveShareAccess
 	PSHARE_ACCESS ShareAccess
 );
 
+EXPORTNUM(79) DLLEXPORT NTSTATUS XBOXAPI IoSetIoCompletion
+(
+	PVOID IoCompletion,
+	PVOID KeyContext,
+	PVOID ApcContext,
+	NTSTATUS IoStatus,
+	ULONG_PTR IoStatusInformation
+);
+
 EXPORTNUM(80) DLLEXPORT VOID XBOXAPI IoSetShareAccess
 (
 	ULONG DesiredAccess,
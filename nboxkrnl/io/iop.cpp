@@ -7,6 +7,7 @@
 #include "cdrom\xiso.hpp"
 #include "raw/raw.hpp"
 #include "nt.hpp"
+#include "mi.hpp"
 
 
 const UCHAR IopValidFsInformationQueries[] = {
@@ -200,6 +201,20 @@ VOID IopDequeueThreadIrp(PIRP Irp)
 	InitializeListHead(&Irp->ThreadListEntry);
 }
 
+VOID IopMakeTransferResident(PIRP Irp, PVOID Buffer, ULONG Length)
+{
+	// Called before the buffer of the irp is handed to the host, which cannot trigger the page faults that would commit the demand zero pages in it
+	if (Irp->Flags & IRP_SCATTER_GATHER_OPERATION) {
+		// Each element of the segment array describes one page of the transfer, and the last one can be partially used when a read was clipped at the end of the file
+		for (ULONG i = 0; i < (ROUND_UP_4K(Length) >> PAGE_SHIFT); ++i) {
+			MiMakeRangeResident(Irp->SegmentArray[i].Buffer, PAGE_SIZE);
+		}
+	}
+	else {
+		MiMakeRangeResident(Buffer, Length);
+	}
+}
+
 VOID ZeroIrpStackLocation(PIO_STACK_LOCATION IrpStackPointer)
 {
 	IrpStackPointer->MinorFunction = 0;
@@ -311,6 +326,26 @@ VOID XBOXAPI IopDeleteFile(PVOID Object)
 	}
 }
 
+VOID XBOXAPI IopDeleteIoCompletion(PVOID Object)
+{
+	// Free the packets that nobody removed from the port. KeRundownQueue returns them as a circular list without a head
+	PLIST_ENTRY FirstEntry = KeRundownQueue((PKQUEUE)Object);
+	if (FirstEntry) {
+		PLIST_ENTRY Entry = FirstEntry;
+		do {
+			PLIST_ENTRY NextEntry = Entry->Flink;
+			PIO_MINI_COMPLETION_PACKET MiniPacket = CONTAINING_RECORD(Entry, IO_MINI_COMPLETION_PACKET, ListEntry);
+			if (MiniPacket->PacketType == IopCompletionPacketIrp) {
+				IoFreeIrp(CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry));
+			}
+			else {
+				ExFreePool(MiniPacket);
+			}
+			Entry = NextEntry;
+		} while (Entry != FirstEntry);
+	}
+}
+
 NTSTATUS XBOXAPI IopParseFile(PVOID ParseObject, POBJECT_TYPE ObjectType, ULONG Attributes, POBJECT_STRING CompleteName, POBJECT_STRING RemainingName,
 	PVOID Context, PVOID *Object)
 {
@@ -335,7 +370,8 @@ VOID XBOXAPI IopCompleteRequest(PKAPC Apc, PKNORMAL_ROUTINE *NormalRoutine, PVOI
 	PIRP Irp = CONTAINING_RECORD(Apc, IRP, Tail.Apc);
 	PFILE_OBJECT FileObject = (PFILE_OBJECT)*SystemArgument1;
 
-	if (!NT_ERROR(Irp->IoStatus.Status)) {
+	// If the request was pending, then the caller already returned and can only learn about a failure from the io status block, event and apc
+	if (!NT_ERROR(Irp->IoStatus.Status) || Irp->PendingReturned) {
 		Irp->UserIosb->Information = Irp->IoStatus.Information;
 		Irp->UserIosb->Status = Irp->IoStatus.Status;
 
@@ -366,6 +402,12 @@ VOID XBOXAPI IopCompleteRequest(PKAPC Apc, PKNORMAL_ROUTINE *NormalRoutine, PVOI
 
 			KeInsertQueueApc(&Irp->Tail.Apc, Irp->UserIosb, nullptr, 2);
 		}
+		else if (FileObject && FileObject->CompletionContext && Irp->Overlay.AsynchronousParameters.UserApcContext) {
+			// The file is associated with a completion port, so queue the irp to it. It will be freed by NtRemoveIoCompletion
+			Irp->Tail.CompletionKey = FileObject->CompletionContext->Key;
+			Irp->Tail.Overlay.PacketType = IopCompletionPacketIrp;
+			KeInsertQueue((PKQUEUE)FileObject->CompletionContext->Port, &Irp->Tail.Overlay.ListEntry);
+		}
 		else {
 			IoFreeIrp(Irp);
 		}
@@ -89,7 +89,6 @@
 #define FILE_USE_FILE_POINTER_POSITION  0xFFFFFFFE
 
 
-using PFILE_SEGMENT_ELEMENT = PVOID;
 using PIO_TIMER = struct IO_TIMER *;
 using DEVICE_TYPE = ULONG;
 using PSECURITY_DESCRIPTOR = PVOID;
@@ -201,6 +200,13 @@ using PIO_APC_ROUTINE = VOID(XBOXAPI *)(
 	ULONG Reserved
 	);
 
+// The completion routine of an overlapped request, called by NtUserIoApcDispatcher. The io status block is the start of the OVERLAPPED of the request
+using POVERLAPPED_COMPLETION_ROUTINE = VOID(XBOXAPI *)(
+	ULONG ErrorCode,
+	ULONG NumberOfBytesTransferred,
+	struct IO_STATUS_BLOCK *IoStatusBlock
+	);
+
 using PDRIVER_CANCEL = VOID(XBOXAPI *)(
 	struct DEVICE_OBJECT *DeviceObject,
 	struct IRP *Irp
@@ -212,6 +218,33 @@ struct IO_COMPLETION_CONTEXT {
 };
 using PIO_COMPLETION_CONTEXT = IO_COMPLETION_CONTEXT *;
 
+enum IO_COMPLETION_PACKET_TYPE {
+	IopCompletionPacketIrp,
+	IopCompletionPacketMini
+};
+
+// Queued to a completion port by IoSetIoCompletion. Completed irps are queued directly instead, using Tail.Overlay.ListEntry and Tail.Overlay.PacketType
+struct IO_MINI_COMPLETION_PACKET {
+	LIST_ENTRY ListEntry;
+	ULONG PacketType;
+	PVOID KeyContext;
+	PVOID ApcContext;
+	NTSTATUS IoStatus;
+	ULONG_PTR IoStatusInformation;
+};
+using PIO_MINI_COMPLETION_PACKET = IO_MINI_COMPLETION_PACKET *;
+
+struct IO_COMPLETION_BASIC_INFORMATION {
+	LONG Depth;
+};
+using PIO_COMPLETION_BASIC_INFORMATION = IO_COMPLETION_BASIC_INFORMATION *;
+
+union FILE_SEGMENT_ELEMENT {
+	PVOID Buffer;
+	ULONG Alignment;
+};
+using PFILE_SEGMENT_ELEMENT = FILE_SEGMENT_ELEMENT *;
+
 struct IO_STATUS_BLOCK {
 	union {
 		NTSTATUS Status;
@@ -366,6 +399,12 @@ struct FILE_POSITION_INFORMATION {
 };
 using PFILE_POSITION_INFORMATION = FILE_POSITION_INFORMATION *;
 
+struct FILE_COMPLETION_INFORMATION {
+	HANDLE Port;
+	PVOID Key;
+};
+using PFILE_COMPLETION_INFORMATION = FILE_COMPLETION_INFORMATION *;
+
 struct FILE_MODE_INFORMATION {
 	ULONG Mode;
 };
@@ -673,12 +712,14 @@ NTSTATUS IopMountDevice(PDEVICE_OBJECT DeviceObject, BOOLEAN AllowRawAccess);
 VOID IopDereferenceDeviceObject(PDEVICE_OBJECT DeviceObject);
 VOID IopQueueThreadIrp(PIRP Irp);
 VOID IopDequeueThreadIrp(PIRP Irp);
+VOID IopMakeTransferResident(PIRP Irp, PVOID Buffer, ULONG Length);
 VOID ZeroIrpStackLocation(PIO_STACK_LOCATION IrpStackPointer);
 VOID IoMarkIrpPending(PIRP Irp);
 PIO_STACK_LOCATION IoGetCurrentIrpStackLocation(PIRP Irp);
 PIO_STACK_LOCATION IoGetNextIrpStackLocation(PIRP Irp);
 VOID XBOXAPI IopCloseFile(PVOID Object, ULONG SystemHandleCount);
 VOID XBOXAPI IopDeleteFile(PVOID Object);
+VOID XBOXAPI IopDeleteIoCompletion(PVOID Object);
 NTSTATUS XBOXAPI IopParseFile(PVOID ParseObject, POBJECT_TYPE ObjectType, ULONG Attributes, POBJECT_STRING CompleteName, POBJECT_STRING RemainingName,
 	PVOID Context, PVOID *Object);
 VOID XBOXAPI IopCompleteRequest(PKAPC Apc, PKNORMAL_ROUTINE *NormalRoutine, PVOID *NormalContext, PVOID *SystemArgument1, PVOID *SystemArgument2);
@@ -258,8 +258,17 @@ static NTSTATUS XBOXAPI RawIrpRead(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 		return RawCompleteRequest(Irp, STATUS_IO_DEVICE_ERROR, VolumeExtension);
 	}
 
+	IopMakeTransferResident(Irp, Buffer, Length);
+
+	ULONG RequestType = IoRequestType::Read;
+	if (Irp->Flags & IRP_SCATTER_GATHER_OPERATION) {
+		// The host transfers one page for each element of the segment array
+		RequestType = IoRequestType::ReadScatter;
+		Buffer = Irp->SegmentArray;
+	}
+
 	IoInfoBlock InfoBlock = SubmitIoRequestToHost(
-		DEV_TYPE(DEV_PARTITION0 + PartitionNumber) | IoRequestType::Read,
+		DEV_TYPE(DEV_PARTITION0 + PartitionNumber) | RequestType,
 		FileOffset.LowPart,
 		Length,
 		(ULONG_PTR)Buffer,
@@ -267,11 +276,7 @@ static NTSTATUS XBOXAPI RawIrpRead(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 	);
 
 	NTSTATUS Status = HostToNtStatus(InfoBlock.Status);
-	if (Status == STATUS_PENDING) {
-		// Should not happen right now, because RetrieveIoRequestFromHost is always synchronous
-		RIP_API_MSG("Asynchronous IO is not supported");
-	}
-	else if (NT_SUCCESS(Status)) {
+	if (NT_SUCCESS(Status)) {
 		if (FileObject->Flags & FO_SYNCHRONOUS_IO) {
 			// NOTE: FileObject->CurrentByteOffset.QuadPart must be updated atomically because RawIrpRead acquires a shared lock, which means it can be concurrently updated
 			atomic_add64(&FileObject->CurrentByteOffset.QuadPart, InfoBlock.Info);
@@ -337,8 +342,17 @@ static NTSTATUS XBOXAPI RawIrpWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 		return RawCompleteRequest(Irp, STATUS_IO_DEVICE_ERROR, VolumeExtension);
 	}
 
+	IopMakeTransferResident(Irp, Buffer, Length);
+
+	ULONG RequestType = IoRequestType::Write;
+	if (Irp->Flags & IRP_SCATTER_GATHER_OPERATION) {
+		// The host transfers one page for each element of the segment array
+		RequestType = IoRequestType::WriteGather;
+		Buffer = Irp->SegmentArray;
+	}
+
 	IoInfoBlock InfoBlock = SubmitIoRequestToHost(
-		DEV_TYPE(DEV_PARTITION0 + PartitionNumber) | IoRequestType::Write,
+		DEV_TYPE(DEV_PARTITION0 + PartitionNumber) | RequestType,
 		FileOffset.LowPart,
 		Length,
 		(ULONG_PTR)Buffer,
@@ -346,11 +360,7 @@ static NTSTATUS XBOXAPI RawIrpWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 	);
 
 	NTSTATUS Status = HostToNtStatus(InfoBlock.Status);
-	if (Status == STATUS_PENDING) {
-		// Should not happen right now, because RetrieveIoRequestFromHost is always synchronous
-		RIP_API_MSG("Asynchronous IO is not supported");
-	}
-	else if (NT_SUCCESS(Status)) {
+	if (NT_SUCCESS(Status)) {
 		if (FileObject->Flags & FO_SYNCHRONOUS_IO) {
 			FileObject->CurrentByteOffset.QuadPart += InfoBlock.Info;
 		}
@@ -27,6 +27,7 @@
 #define CLOCK_LEVEL 28
 #define SYNC_LEVEL CLOCK_LEVEL
 #define SMBUS_LEVEL 15
+#define IDE_LEVEL 12
 #define DISPATCH_LEVEL 2
 #define APC_LEVEL 1
 #define PASSIVE_LEVEL 0
@@ -525,6 +526,12 @@ EXPORTNUM(110) DLLEXPORT VOID XBOXAPI KeInitializeMutant
 	BOOLEAN InitialOwner
 );
 
+EXPORTNUM(111) DLLEXPORT VOID XBOXAPI KeInitializeQueue
+(
+	PKQUEUE Queue,
+	ULONG Count
+);
+
 EXPORTNUM(112) DLLEXPORT VOID XBOXAPI KeInitializeSemaphore
 (
 	PKSEMAPHORE Semaphore,
@@ -538,6 +545,18 @@ EXPORTNUM(113) DLLEXPORT VOID XBOXAPI KeInitializeTimerEx
 	TIMER_TYPE Type
 );
 
+EXPORTNUM(116) DLLEXPORT LONG XBOXAPI KeInsertHeadQueue
+(
+	PKQUEUE Queue,
+	PLIST_ENTRY Entry
+);
+
+EXPORTNUM(117) DLLEXPORT LONG XBOXAPI KeInsertQueue
+(
+	PKQUEUE Queue,
+	PLIST_ENTRY Entry
+);
+
 EXPORTNUM(118) DLLEXPORT BOOLEAN XBOXAPI KeInsertQueueApc
 (
 	PKAPC Apc,
@@ -588,11 +607,23 @@ EXPORTNUM(132) DLLEXPORT LONG XBOXAPI KeReleaseSemaphore
 	BOOLEAN Wait
 );
 
+EXPORTNUM(136) DLLEXPORT PLIST_ENTRY XBOXAPI KeRemoveQueue
+(
+	PKQUEUE Queue,
+	KPROCESSOR_MODE WaitMode,
+	PLARGE_INTEGER Timeout
+);
+
 EXPORTNUM(140) DLLEXPORT ULONG XBOXAPI KeResumeThread
 (
 	PKTHREAD Thread
 );
 
+EXPORTNUM(141) DLLEXPORT PLIST_ENTRY XBOXAPI KeRundownQueue
+(
+	PKQUEUE Queue
+);
+
 EXPORTNUM(145) DLLEXPORT LONG XBOXAPI KeSetEvent
 (
 	PKEVENT Event,
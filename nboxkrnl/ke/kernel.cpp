@@ -7,6 +7,7 @@
 
 #include "ki.hpp"
 #include "..\kernel.hpp"
+#include "ex.hpp"
 #include <assert.h>
 
 #define XBOX_ACPI_FREQUENCY 3375000 // 3.375 MHz
@@ -180,6 +181,101 @@ VOID KeSetSystemTime(PLARGE_INTEGER NewTime, PLARGE_INTEGER OldTime)
 	KiTimerListExpire(&TempList2, OldIrql);
 }
 
+// Tracks a I/O request whose completion will be signalled by the host with the IDE interrupt
+struct IoPendingRequest {
+	LIST_ENTRY ListEntry;
+	KEVENT Event;
+	ULONGLONG Id;
+	IoInfoBlock InfoBlock;
+	PIO_HOST_COMPLETION_ROUTINE CompletionRoutine; // only used by asynchronous requests
+	PVOID Context;
+};
+
+// List of I/O requests submitted to the host and not yet completed, synchronized at DISPATCH_LEVEL
+static LIST_ENTRY IoPendingRequestListHead = { &IoPendingRequestListHead, &IoPendingRequestListHead };
+
+// Shared memory rings used to exchange I/O requests with the host, when it supports them
+static IoRing IoHostRing;
+static ULONG IoRingRequestsInFlight = 0;
+
+// Filled by the host with the completed requests when the rings are not used, only accessed by the IDE dpc
+static IoCompletionList IoHostCompletionList;
+
+VOID RegisterIoRingWithHost()
+{
+	IoHostRing.SubmissionHead = IoHostRing.SubmissionTail = 0;
+	IoHostRing.CompletionHead = IoHostRing.CompletionTail = 0;
+	IoHostRing.Flags = IO_RING_NEED_WAKEUP;
+
+	outl(IO_RING_REGISTER, (ULONG_PTR)&IoHostRing);
+	IoRingEnabled = inl(IO_RING_REGISTER) == 1;
+}
+
+static VOID CompletePendingRequest(IoPendingRequest *PendingRequest)
+{
+	RemoveEntryList(&PendingRequest->ListEntry);
+
+	if (PendingRequest->CompletionRoutine) {
+		// Asynchronous request: nobody is waiting for it, so we own the request and must free it
+		PendingRequest->CompletionRoutine(PendingRequest->InfoBlock, PendingRequest->Context);
+		ExFreePool(PendingRequest);
+	}
+	else {
+		KeSetEvent(&PendingRequest->Event, PRIORITY_BOOST_IO, FALSE);
+	}
+}
+
+static VOID CompletePendingRequestById(IoCompletionEntry *Completion)
+{
+	// Looks up the pending request that the host has reported as completed
+	PLIST_ENTRY Entry = IoPendingRequestListHead.Flink;
+	while (Entry != &IoPendingRequestListHead) {
+		IoPendingRequest *PendingRequest = CONTAINING_RECORD(Entry, IoPendingRequest, ListEntry);
+		if (PendingRequest->Id == Completion->Id) {
+			PendingRequest->InfoBlock = Completion->Info;
+			PendingRequest->InfoBlock.Ready = 1;
+			CompletePendingRequest(PendingRequest);
+			break;
+		}
+		Entry = Entry->Flink;
+	}
+}
+
+static VOID ReapIoCompletionRing()
+{
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	ULONG Head = IoHostRing.CompletionHead;
+	while (Head != IoHostRing.CompletionTail) {
+		CompletePendingRequestById(&IoHostRing.Completion[Head & (IO_RING_ENTRIES - 1)]);
+
+		++Head;
+		--IoRingRequestsInFlight;
+	}
+
+	IoHostRing.CompletionHead = Head;
+}
+
+static VOID SubmitIoRequestToRing(IoRequest *Request)
+{
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	// Never have more requests in flight than completion entries, so that the host cannot overflow the completion ring
+	while (IoRingRequestsInFlight == IO_RING_ENTRIES) {
+		ReapIoCompletionRing();
+	}
+
+	++IoRingRequestsInFlight;
+	ULONG Tail = IoHostRing.SubmissionTail;
+	IoHostRing.Submission[Tail & (IO_RING_ENTRIES - 1)] = *Request;
+	IoHostRing.SubmissionTail = Tail + 1;
+
+	// Only exit to the host when it's not already draining the submission ring, so that requests queued meanwhile are batched together
+	if (IoHostRing.Flags & IO_RING_NEED_WAKEUP) {
+		outl(IO_RING_DOORBELL, 0);
+	}
+}
+
 static VOID SubmitIoRequestToHost(IoRequest *Request)
 {
 	outl(IO_START, (ULONG_PTR)Request);
@@ -190,7 +286,7 @@ static VOID SubmitIoRequestToHost(IoRequest *Request)
 
 static VOID RetrieveIoRequestFromHost(volatile IoInfoBlock *Info, ULONGLONG Id)
 {
-	// TODO: instead of polling the IO like this, the host should signal I/O completion by raising a HDD interrupt, so that we can handle the event in the ISR
+	// NOTE: this is only used when the host cannot raise the IDE interrupt, or when the caller cannot block (early boot, IRQL >= DISPATCH_LEVEL)
 
 	Info->Info2OrId = Id;
 	Info->Ready = 0;
@@ -202,7 +298,6 @@ static VOID RetrieveIoRequestFromHost(volatile IoInfoBlock *Info, ULONGLONG Id)
 
 IoInfoBlock SubmitIoRequestToHost(ULONG Type, LONGLONG OffsetOrInitialSize, ULONG Size, ULONGLONG HandleOrAddress, ULONGLONG HandleOrPath)
 {
-	IoInfoBlock InfoBlock;
 	IoRequest Packet;
 	Packet.Id = InterlockedIncrement64(&IoRequestId);
 	Packet.Type = Type;
@@ -210,12 +305,119 @@ IoInfoBlock SubmitIoRequestToHost(ULONG Type, LONGLONG OffsetOrInitialSize, ULON
 	Packet.OffsetOrInitialSize = OffsetOrInitialSize;
 	Packet.Size = Size;
 	Packet.HandleOrPath = HandleOrPath;
+
+	KIRQL CurrentIrql = KeGetCurrentIrql();
+	BOOLEAN CanWait = IoInterruptEnabled && (CurrentIrql < DISPATCH_LEVEL) && (KeGetCurrentThread() != KiPcr.Prcb->IdleThread);
+
+	// Above DISPATCH_LEVEL we can't raise to DISPATCH_LEVEL to synchronize with the dpc, so use the polling path instead
+	if ((IoRingEnabled && (CurrentIrql <= DISPATCH_LEVEL)) || CanWait) {
+		IoPendingRequest PendingRequest;
+		KeInitializeEvent(&PendingRequest.Event, NotificationEvent, FALSE);
+		PendingRequest.Id = Packet.Id;
+		PendingRequest.InfoBlock.Info2OrId = Packet.Id;
+		PendingRequest.InfoBlock.Ready = 0;
+		PendingRequest.CompletionRoutine = nullptr;
+
+		// Queue the request before submitting it, so that the dpc cannot miss its completion
+		KIRQL OldIrql = KeRaiseIrqlToDpcLevel();
+		InsertTailList(&IoPendingRequestListHead, &PendingRequest.ListEntry);
+		if (IoRingEnabled) {
+			SubmitIoRequestToRing(&Packet);
+		}
+		else {
+			SubmitIoRequestToHost(&Packet);
+		}
+
+		if (CanWait) {
+			KfLowerIrql(OldIrql);
+			KeWaitForSingleObject(&PendingRequest.Event, Executive, KernelMode, FALSE, nullptr); // wait until the request is completed by the dpc
+		}
+		else {
+			// We cannot block, so spin on the completion ring instead. This doesn't cause exits to the host
+			volatile IoInfoBlock *Info = &PendingRequest.InfoBlock;
+			while (!Info->Ready) {
+				ReapIoCompletionRing();
+			}
+			KfLowerIrql(OldIrql);
+		}
+
+		return PendingRequest.InfoBlock;
+	}
+
+	IoInfoBlock InfoBlock;
 	SubmitIoRequestToHost(&Packet);
 	RetrieveIoRequestFromHost(&InfoBlock, Packet.Id);
 
 	return InfoBlock;
 }
 
+BOOLEAN SubmitIoRequestToHostAsync(ULONG Type, LONGLONG OffsetOrInitialSize, ULONG Size, ULONGLONG HandleOrAddress, ULONGLONG HandleOrPath,
+	PIO_HOST_COMPLETION_ROUTINE CompletionRoutine, PVOID Context)
+{
+	// Without the IDE interrupt, nothing would ever notice the completion of the request, so the caller must use SubmitIoRequestToHost instead
+	if (!IoInterruptEnabled) {
+		return FALSE;
+	}
+
+	// The pending list is synchronized at DISPATCH_LEVEL, so it can't be touched from a higher irql. Let the caller poll instead
+	if (KeGetCurrentIrql() > DISPATCH_LEVEL) {
+		return FALSE;
+	}
+
+	IoPendingRequest *PendingRequest = (IoPendingRequest *)ExAllocatePoolWithTag(sizeof(IoPendingRequest), 'qRoI');
+	if (PendingRequest == nullptr) {
+		return FALSE;
+	}
+
+	IoRequest Packet;
+	Packet.Id = InterlockedIncrement64(&IoRequestId);
+	Packet.Type = Type;
+	Packet.HandleOrAddress = HandleOrAddress;
+	Packet.OffsetOrInitialSize = OffsetOrInitialSize;
+	Packet.Size = Size;
+	Packet.HandleOrPath = HandleOrPath;
+
+	PendingRequest->Id = Packet.Id;
+	PendingRequest->InfoBlock.Info2OrId = Packet.Id;
+	PendingRequest->InfoBlock.Ready = 0;
+	PendingRequest->CompletionRoutine = CompletionRoutine;
+	PendingRequest->Context = Context;
+
+	KIRQL OldIrql = KeRaiseIrqlToDpcLevel();
+	InsertTailList(&IoPendingRequestListHead, &PendingRequest->ListEntry);
+	if (IoRingEnabled) {
+		SubmitIoRequestToRing(&Packet);
+	}
+	else {
+		SubmitIoRequestToHost(&Packet);
+	}
+	KfLowerIrql(OldIrql);
+
+	return TRUE;
+}
+
+VOID CompleteIoRequestsFromHost()
+{
+	// Called from the IDE dpc. The interrupt doesn't tell us which requests are done, so ask the host for the list of the completed ones. This takes a single exit
+	// to the host, no matter how many requests are pending
+
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	if (IoRingEnabled) {
+		ReapIoCompletionRing();
+		return;
+	}
+
+	do {
+		IoHostCompletionList.NumOfEntries = 0;
+		outl(IO_QUERY_COMPLETED, (ULONG_PTR)&IoHostCompletionList);
+
+		for (ULONG i = 0; i < IoHostCompletionList.NumOfEntries; ++i) {
+			CompletePendingRequestById(&IoHostCompletionList.Entries[i]);
+		}
+	} while (IoHostCompletionList.NumOfEntries == IO_COMPLETION_LIST_ENTRIES);
+}
+
 ULONGLONG FASTCALL InterlockedIncrement64(volatile PULONGLONG Addend)
 {
 	__asm {
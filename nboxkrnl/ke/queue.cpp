@@ -0,0 +1,240 @@
+/*
+ * ergo720                Copyright (c) 2023
+ */
+
+#include "ki.hpp"
+#include <assert.h>
+
+
+static LONG KiInsertQueue(PKQUEUE Queue, PLIST_ENTRY Entry, BOOLEAN Head)
+{
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	LONG OldState = Queue->Header.SignalState;
+	PKTHREAD Thread = KeGetCurrentThread();
+
+	// Waiters are inserted at the tail of the wait list, so taking the last one wakes the thread that blocked most recently. Such thread is the most likely one to still
+	// have its working set in the cache. Don't wake a waiter if the current thread is itself a worker of this queue, because it will take the entry when it waits again
+	PLIST_ENTRY WaitEntry = Queue->Header.WaitListHead.Blink;
+	if ((WaitEntry != &Queue->Header.WaitListHead) && (Queue->CurrentCount < Queue->MaximumCount) &&
+		((Thread->Queue != Queue) || (Thread->WaitReason != WrQueue))) {
+		PKWAIT_BLOCK WaitBlock = CONTAINING_RECORD(WaitEntry, KWAIT_BLOCK, WaitListEntry);
+		KiUnwaitThread(WaitBlock->Thread, (LONG_PTR)Entry, 0); // this also increments CurrentCount, because the waiter is associated with the queue
+	}
+	else {
+		Queue->Header.SignalState += 1;
+		if (Head) {
+			InsertHeadList(&Queue->EntryListHead, Entry);
+		}
+		else {
+			InsertTailList(&Queue->EntryListHead, Entry);
+		}
+	}
+
+	return OldState;
+}
+
+VOID KiActivateWaiterQueue(PKQUEUE Queue)
+{
+	// Called when a thread associated with the queue blocks on something else than the queue itself, so that another worker can run in its place
+
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	Queue->CurrentCount -= 1;
+	if (Queue->CurrentCount < Queue->MaximumCount) {
+		PLIST_ENTRY Entry = Queue->EntryListHead.Flink;
+		PLIST_ENTRY WaitEntry = Queue->Header.WaitListHead.Blink;
+		if ((Entry != &Queue->EntryListHead) && (WaitEntry != &Queue->Header.WaitListHead)) {
+			RemoveEntryList(Entry);
+			Entry->Flink = nullptr;
+			Queue->Header.SignalState -= 1;
+			PKWAIT_BLOCK WaitBlock = CONTAINING_RECORD(WaitEntry, KWAIT_BLOCK, WaitListEntry);
+			KiUnwaitThread(WaitBlock->Thread, (LONG_PTR)Entry, 0);
+		}
+	}
+}
+
+EXPORTNUM(111) VOID XBOXAPI KeInitializeQueue
+(
+	PKQUEUE Queue,
+	ULONG Count
+)
+{
+	Queue->Header.Type = QueueObject;
+	Queue->Header.Size = sizeof(KQUEUE) / sizeof(LONG);
+	Queue->Header.SignalState = 0;
+	InitializeListHead(&Queue->Header.WaitListHead);
+	InitializeListHead(&Queue->EntryListHead);
+	InitializeListHead(&Queue->ThreadListHead);
+	Queue->CurrentCount = 0;
+	Queue->MaximumCount = Count ? Count : 1; // there's only one processor on the xbox
+}
+
+EXPORTNUM(116) LONG XBOXAPI KeInsertHeadQueue
+(
+	PKQUEUE Queue,
+	PLIST_ENTRY Entry
+)
+{
+	KIRQL OldIrql = KeRaiseIrqlToDpcLevel();
+	LONG OldState = KiInsertQueue(Queue, Entry, TRUE);
+	KiUnlockDispatcherDatabase(OldIrql);
+
+	return OldState;
+}
+
+EXPORTNUM(117) LONG XBOXAPI KeInsertQueue
+(
+	PKQUEUE Queue,
+	PLIST_ENTRY Entry
+)
+{
+	KIRQL OldIrql = KeRaiseIrqlToDpcLevel();
+	LONG OldState = KiInsertQueue(Queue, Entry, FALSE);
+	KiUnlockDispatcherDatabase(OldIrql);
+
+	return OldState;
+}
+
+EXPORTNUM(136) PLIST_ENTRY XBOXAPI KeRemoveQueue
+(
+	PKQUEUE Queue,
+	KPROCESSOR_MODE WaitMode,
+	PLARGE_INTEGER Timeout
+)
+{
+	PKTHREAD Thread = KeGetCurrentThread();
+	if (Thread->WaitNext) {
+		Thread->WaitNext = FALSE;
+	}
+	else {
+		Thread->WaitIrql = KeRaiseIrqlToDpcLevel();
+	}
+
+	// If the thread was associated with another queue, then it leaves it and a waiter of the old queue can run in its place. Otherwise, this thread is done with
+	// the entry it previously removed from this queue
+	PKQUEUE OldQueue = Thread->Queue;
+	Thread->Queue = Queue;
+	if (Queue != OldQueue) {
+		if (OldQueue) {
+			RemoveEntryList(&Thread->QueueListEntry);
+			KiActivateWaiterQueue(OldQueue);
+		}
+		InsertTailList(&Queue->ThreadListHead, &Thread->QueueListEntry);
+	}
+	else {
+		Queue->CurrentCount -= 1;
+	}
+
+	PLIST_ENTRY Entry;
+	KWAIT_BLOCK LocalWaitBlock;
+	LARGE_INTEGER DueTime, DummyTime;
+	PLARGE_INTEGER CapturedTimeout = Timeout;
+	PKWAIT_BLOCK WaitBlock = &LocalWaitBlock;
+	while (true) {
+		Entry = Queue->EntryListHead.Flink;
+		if ((Entry != &Queue->EntryListHead) && (Queue->CurrentCount < Queue->MaximumCount)) {
+			Queue->Header.SignalState -= 1;
+			Queue->CurrentCount += 1;
+			RemoveEntryList(Entry);
+			Entry->Flink = nullptr;
+			break;
+		}
+
+		Thread->WaitStatus = STATUS_SUCCESS;
+		Thread->WaitBlockList = WaitBlock;
+		WaitBlock->Object = Queue;
+		WaitBlock->WaitKey = (USHORT)STATUS_SUCCESS;
+		WaitBlock->WaitType = WaitAny;
+		WaitBlock->Thread = Thread;
+
+		if ((WaitMode == UserMode) && Thread->ApcState.UserApcPending) {
+			Entry = (PLIST_ENTRY)STATUS_USER_APC;
+			Queue->CurrentCount += 1;
+			break;
+		}
+
+		if (Timeout) {
+			if (Timeout->QuadPart == 0) {
+				Entry = (PLIST_ENTRY)STATUS_TIMEOUT;
+				Queue->CurrentCount += 1;
+				break;
+			}
+
+			PKTIMER Timer = &Thread->Timer;
+			PKWAIT_BLOCK WaitTimer = &Thread->TimerWaitBlock;
+			WaitBlock->NextWaitBlock = WaitTimer;
+			Timer->Header.WaitListHead.Flink = &WaitTimer->WaitListEntry;
+			Timer->Header.WaitListHead.Blink = &WaitTimer->WaitListEntry;
+			WaitTimer->NextWaitBlock = WaitBlock;
+			if (KiInsertTimer(Timer, *Timeout) == FALSE) {
+				Entry = (PLIST_ENTRY)STATUS_TIMEOUT;
+				Queue->CurrentCount += 1;
+				break;
+			}
+
+			DueTime.QuadPart = Timer->DueTime.QuadPart;
+		}
+		else {
+			WaitBlock->NextWaitBlock = WaitBlock;
+		}
+
+		InsertTailList(&Queue->Header.WaitListHead, &WaitBlock->WaitListEntry);
+
+		Thread->Alertable = FALSE;
+		Thread->WaitMode = WaitMode;
+		Thread->WaitReason = WrQueue;
+		Thread->WaitTime = KeTickCount;
+		Thread->State = Waiting;
+		InsertTailList(&KiWaitInListHead, &Thread->WaitListEntry);
+
+		// Returns either with a kernel APC, a timeout or the entry that was inserted in the queue. In all cases, KiUnwaitThread already incremented CurrentCount
+		Entry = (PLIST_ENTRY)KiSwapThread();
+
+		if (Entry == (PLIST_ENTRY)STATUS_USER_APC) {
+			RIP_API_MSG("User APCs are not supported");
+		}
+
+		if (Entry != (PLIST_ENTRY)STATUS_KERNEL_APC) {
+			return Entry;
+		}
+
+		if (Timeout) {
+			Timeout = KiRecalculateTimerDueTime(CapturedTimeout, &DueTime, &DummyTime);
+		}
+
+		Thread->WaitIrql = KeRaiseIrqlToDpcLevel();
+		Queue->CurrentCount -= 1;
+	}
+
+	KiUnlockDispatcherDatabase(Thread->WaitIrql);
+
+	return Entry;
+}
+
+EXPORTNUM(141) PLIST_ENTRY XBOXAPI KeRundownQueue
+(
+	PKQUEUE Queue
+)
+{
+	KIRQL OldIrql = KeRaiseIrqlToDpcLevel();
+
+	// Detach the entries from the queue and return them to the caller as a circular list without a head
+	PLIST_ENTRY FirstEntry = Queue->EntryListHead.Flink;
+	if (FirstEntry == &Queue->EntryListHead) {
+		FirstEntry = nullptr;
+	}
+	else {
+		RemoveEntryList(&Queue->EntryListHead);
+	}
+
+	while (IsListEmpty(&Queue->ThreadListHead) == FALSE) {
+		PKTHREAD Thread = CONTAINING_RECORD(Queue->ThreadListHead.Flink, KTHREAD, QueueListEntry);
+		Thread->Queue = nullptr;
+		RemoveEntryList(&Thread->QueueListEntry);
+	}
+
+	KiUnlockDispatcherDatabase(OldIrql);
+
+	return FirstEntry;
+}
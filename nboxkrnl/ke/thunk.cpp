@@ -56,7 +56,7 @@ ULONG KernelThunkTable[379] =
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&ExfInterlockedInsertTailList),            // 0x0021 (33)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&ExfInterlockedRemoveHeadList),            // 0x0022 (34)
 	(ULONG)FUNC(&FscGetCacheSize),                         // 0x0023 (35)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&FscInvalidateIdleBlocks),                 // 0x0024 (36)
+	(ULONG)FUNC(&FscInvalidateIdleBlocks),                 // 0x0024 (36)
 	(ULONG)FUNC(&FscSetCacheSize),                         // 0x0025 (37)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&HalClearSoftwareInterrupt),               // 0x0026 (38)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&HalDisableSystemInterrupt),               // 0x0027 (39)
@@ -84,7 +84,7 @@ ULONG KernelThunkTable[379] =
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&IoBuildDeviceIoControlRequest),           // 0x003D (61)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&IoBuildSynchronousFsdRequest),            // 0x003E (62)
 	(ULONG)FUNC(&IoCheckShareAccess),                      // 0x003F (63)
-	(ULONG)FUNC(nullptr), //(ULONG)VARIABLE(&IoCompletionObjectType),              // 0x0040 (64)
+	(ULONG)VARIABLE(&IoCompletionObjectType),              // 0x0040 (64)
 	(ULONG)FUNC(&IoCreateDevice),                          // 0x0041 (65)
 	(ULONG)FUNC(&IoCreateFile),                            // 0x0042 (66)
 	(ULONG)FUNC(&IoCreateSymbolicLink),                    // 0x0043 (67)
@@ -99,7 +99,7 @@ ULONG KernelThunkTable[379] =
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&IoQueryVolumeInformation),                // 0x004C (76)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&IoQueueThreadIrp),                        // 0x004D (77)
 	(ULONG)FUNC(&IoRemoveShareAccess),                     // 0x004E (78)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&IoSetIoCompletion),                       // 0x004F (79)
+	(ULONG)FUNC(&IoSetIoCompletion),                       // 0x004F (79)
 	(ULONG)FUNC(&IoSetShareAccess),                        // 0x0050 (80)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&IoStartNextPacket),                       // 0x0051 (81)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&IoStartNextPacketByKey),                  // 0x0052 (82)
@@ -131,13 +131,13 @@ ULONG KernelThunkTable[379] =
 	(ULONG)FUNC(&KeInitializeEvent),                       // 0x006C (108)
 	(ULONG)FUNC(&KeInitializeInterrupt),                   // 0x006D (109)
 	(ULONG)FUNC(&KeInitializeMutant),                      // 0x006E (110)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeInitializeQueue),                       // 0x006F (111)
+	(ULONG)FUNC(&KeInitializeQueue),                       // 0x006F (111)
 	(ULONG)FUNC(&KeInitializeSemaphore),                   // 0x0070 (112)
 	(ULONG)FUNC(&KeInitializeTimerEx),                     // 0x0071 (113)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeInsertByKeyDeviceQueue),                // 0x0072 (114)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeInsertDeviceQueue),                     // 0x0073 (115)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeInsertHeadQueue),                       // 0x0074 (116)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeInsertQueue),                           // 0x0075 (117)
+	(ULONG)FUNC(&KeInsertHeadQueue),                       // 0x0074 (116)
+	(ULONG)FUNC(&KeInsertQueue),                           // 0x0075 (117)
 	(ULONG)FUNC(&KeInsertQueueApc),                        // 0x0076 (118)
 	(ULONG)FUNC(&KeInsertQueueDpc),                        // 0x0077 (119)
 	(ULONG)VARIABLE(&KeInterruptTime),                     // 0x0078 (120) KeInterruptTime
@@ -156,12 +156,12 @@ ULONG KernelThunkTable[379] =
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeRemoveByKeyDeviceQueue),                // 0x0085 (133)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeRemoveDeviceQueue),                     // 0x0086 (134)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeRemoveEntryDeviceQueue),                // 0x0087 (135)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeRemoveQueue),                           // 0x0088 (136)
+	(ULONG)FUNC(&KeRemoveQueue),                           // 0x0088 (136)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeRemoveQueueDpc),                        // 0x0089 (137)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeResetEvent),                            // 0x008A (138)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeRestoreFloatingPointState),             // 0x008B (139)
 	(ULONG)FUNC(&KeResumeThread),                          // 0x008C (140)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeRundownQueue),                          // 0x008D (141)
+	(ULONG)FUNC(&KeRundownQueue),                          // 0x008D (141)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeSaveFloatingPointState),                // 0x008E (142)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeSetBasePriorityThread),                 // 0x008F (143)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&KeSetDisableBoostThread),                 // 0x0090 (144)
@@ -211,7 +211,7 @@ ULONG KernelThunkTable[379] =
 	(ULONG)FUNC(&NtCreateDirectoryObject),                 // 0x00BC (188)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtCreateEvent),                           // 0x00BD (189)
 	(ULONG)FUNC(&NtCreateFile),                            // 0x00BE (190)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtCreateIoCompletion),                    // 0x00BF (191)
+	(ULONG)FUNC(&NtCreateIoCompletion),                    // 0x00BF (191)
 	(ULONG)FUNC(&NtCreateMutant),                          // 0x00C0 (192)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtCreateSemaphore),                       // 0x00C1 (193)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtCreateTimer),                           // 0x00C2 (194)
@@ -232,7 +232,7 @@ ULONG KernelThunkTable[379] =
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtQueryEvent),                            // 0x00D1 (209)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtQueryFullAttributesFile),               // 0x00D2 (210)
 	(ULONG)FUNC(&NtQueryInformationFile),                  // 0x00D3 (211)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtQueryIoCompletion),                     // 0x00D4 (212)
+	(ULONG)FUNC(&NtQueryIoCompletion),                     // 0x00D4 (212)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtQueryMutant),                           // 0x00D5 (213)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtQuerySemaphore),                        // 0x00D6 (214)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtQuerySymbolicLinkObject),               // 0x00D7 (215)
@@ -240,14 +240,14 @@ ULONG KernelThunkTable[379] =
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtQueryVirtualMemory),                    // 0x00D9 (217)
 	(ULONG)FUNC(&NtQueryVolumeInformationFile),            // 0x00DA (218)
 	(ULONG)FUNC(&NtReadFile),                              // 0x00DB (219)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtReadFileScatter),                       // 0x00DC (220)
+	(ULONG)FUNC(&NtReadFileScatter),                       // 0x00DC (220)
 	(ULONG)FUNC(&NtReleaseMutant),                         // 0x00DD (221)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtReleaseSemaphore),                      // 0x00DE (222)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtRemoveIoCompletion),                    // 0x00DF (223)
+	(ULONG)FUNC(&NtRemoveIoCompletion),                    // 0x00DF (223)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtResumeThread),                          // 0x00E0 (224)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtSetEvent),                              // 0x00E1 (225)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtSetInformationFile),                    // 0x00E2 (226)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtSetIoCompletion),                       // 0x00E3 (227)
+	(ULONG)FUNC(&NtSetInformationFile),                    // 0x00E2 (226)
+	(ULONG)FUNC(&NtSetIoCompletion),                       // 0x00E3 (227)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtSetSystemTime),                         // 0x00E4 (228)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtSetTimerEx),                            // 0x00E5 (229)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtSignalAndWaitForSingleObjectEx),        // 0x00E6 (230)
@@ -257,7 +257,7 @@ ULONG KernelThunkTable[379] =
 	(ULONG)FUNC(&NtWaitForSingleObjectEx),                 // 0x00EA (234)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtWaitForMultipleObjectsEx),              // 0x00EB (235)
 	(ULONG)FUNC(&NtWriteFile),                             // 0x00EC (236)
-	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtWriteFileGather),                       // 0x00ED (237)
+	(ULONG)FUNC(&NtWriteFileGather),                       // 0x00ED (237)
 	(ULONG)FUNC(nullptr), //(ULONG)FUNC(&NtYieldExecution),                        // 0x00EE (238)
 	(ULONG)FUNC(&ObCreateObject),                          // 0x00EF (239)
 	(ULONG)VARIABLE(&ObDirectoryObjectType),               // 0x00F0 (240)
@@ -95,7 +95,7 @@ EXPORTNUM(99) NTSTATUS XBOXAPI KeDelayExecutionThread
 		DueTime.QuadPart = Timer->DueTime.QuadPart;
 
 		if (Thread->Queue) {
-			RIP_API_MSG("Thread queues are not supported");
+			KiActivateWaiterQueue(Thread->Queue);
 		}
 
 		Thread->Alertable = Alertable;
@@ -228,7 +228,7 @@ EXPORTNUM(159) DLLEXPORT NTSTATUS XBOXAPI KeWaitForSingleObject
 		InsertTailList(&Mutant->Header.WaitListHead, &WaitBlock->WaitListEntry);
 
 		if (Thread->Queue) {
-			RIP_API_MSG("Thread queues are not supported");
+			KiActivateWaiterQueue(Thread->Queue);
 		}
 
 		Thread->Alertable = Alertable;
@@ -321,8 +321,9 @@ VOID KiUnwaitThread(PKTHREAD Thread, LONG_PTR WaitStatus, KPRIORITY Increment)
 		KiRemoveTimer(&Thread->Timer);
 	}
 
+	// The thread is going to run again, so it counts again against the concurrency limit of its queue
 	if (Thread->Queue) {
-		RIP_API_MSG("Thread queues are not supported");
+		Thread->Queue->CurrentCount += 1;
 	}
 
 	if (Thread->Priority < LOW_REALTIME_PRIORITY) {
@@ -31,6 +31,10 @@
 #define DVD_MEDIA_TYPE 0x209
 // Check if a I/O request was submitted successfully
 #define IO_CHECK_ENQUEUE 0x20A
+// Ask the host to raise the IDE interrupt when a I/O request is complete, reads back 1 if the host supports it. Such a host must also support IO_QUERY_COMPLETED
+#define IO_INTERRUPT_ENABLE 0x20B
+// Send the address of the shared memory I/O rings, reads back 1 if the host supports them
+#define IO_RING_REGISTER 0x20C
 // Request the path's length of the XBE to launch when no reboot occured
 #define XE_XBE_PATH_LENGTH 0x20D
 // Send the address where to put the path of the XBE to launch when no reboot occured
@@ -38,6 +42,10 @@
 // Request the total ACPI time since booting
 #define KE_ACPI_TIME_LOW 0x20F
 #define KE_ACPI_TIME_HIGH 0x210
+// Notify the host that new I/O requests were queued in the submission ring
+#define IO_RING_DOORBELL 0x211
+// Send the address of a IoCompletionList, that the host fills with the I/O requests completed since the last query
+#define IO_QUERY_COMPLETED 0x212
 
 #define KERNEL_STACK_SIZE 12288
 #define KERNEL_BASE 0x80010000
@@ -69,6 +77,13 @@
 #define PARTITION7_HANDLE DEV_PARTITION7
 #define FIRST_FREE_HANDLE NUM_OF_DEVS
 
+// Number of entries of the I/O rings, must be a power of two
+#define IO_RING_ENTRIES 64
+// Set by the host when it stops polling the submission ring, so that the guest must ring the doorbell to wake it up
+#define IO_RING_NEED_WAKEUP (1 << 0)
+// Number of entries of the list filled by IO_QUERY_COMPLETED
+#define IO_COMPLETION_LIST_ENTRIES 16
+
 #define LOWER_32(A) ((A) & 0xFFFFFFFF)
 #define UPPER_32(A) ((A) >> 32)
 
@@ -79,11 +94,13 @@ enum SystemType {
 };
 
 enum IoRequestType : ULONG {
-	Open       = 1 << 28,
-	Remove     = 2 << 28,
-	Close      = 3 << 28,
-	Read       = 4 << 28,
-	Write      = 5 << 28,
+	Open        = 1 << 28,
+	Remove      = 2 << 28,
+	Close       = 3 << 28,
+	Read        = 4 << 28,
+	Write       = 5 << 28,
+	ReadScatter = 6 << 28,
+	WriteGather = 7 << 28,
 };
 
 enum IoFlags : ULONG {
@@ -122,7 +139,7 @@ struct IoRequest {
 	ULONG Type; // type of request and flags
 	LONGLONG OffsetOrInitialSize; // file offset from which to start the I/O or file initial size
 	ULONG Size; // bytes to transfer or size of path for open/create requests
-	ULONGLONG HandleOrAddress; // virtual address of the data to transfer or file handle for open/create requests
+	ULONGLONG HandleOrAddress; // virtual address of the data to transfer, of the page segment array for scatter/gather requests, or file handle for open/create requests
 	ULONGLONG HandleOrPath; // file handle or file path for open/create requests
 };
 
@@ -132,6 +149,29 @@ struct IoInfoBlock {
 	uint64_t Info2OrId; // extra info or id of the io request to query
 	uint32_t Ready; // set to 0 by the guest, then set to 1 by the host when the io request is complete
 };
+
+struct IoCompletionEntry {
+	ULONGLONG Id; // id of the completed io request
+	IoInfoBlock Info;
+};
+
+// Shared with the host, which registers it once at boot. The guest produces requests in Submission and consumes completions from Completion
+struct IoRing {
+	volatile ULONG SubmissionHead; // advanced by the host when it consumes a request
+	volatile ULONG SubmissionTail; // advanced by the guest when it queues a request
+	volatile ULONG CompletionHead; // advanced by the guest when it reaps a completion
+	volatile ULONG CompletionTail; // advanced by the host when it posts a completion
+	volatile ULONG Flags;
+	IoRequest Submission[IO_RING_ENTRIES];
+	IoCompletionEntry Completion[IO_RING_ENTRIES];
+};
+
+// Filled by the host on IO_QUERY_COMPLETED. When all entries are used, more completed requests could be left, so the guest must query again. Reported requests
+// can still be retrieved with IO_QUERY, since the ones submitted while polling are not tracked by the dpc
+struct IoCompletionList {
+	ULONG NumOfEntries; // number of valid entries, set by the host
+	IoCompletionEntry Entries[IO_COMPLETION_LIST_ENTRIES];
+};
 #pragma pack()
 
 struct XBOX_HARDWARE_INFO {
@@ -153,6 +193,8 @@ inline SystemType XboxType;
 inline ULONG IoDvdInputType; // 0: xbe, 1: xiso
 inline ULONGLONG IoRequestId = 0;
 inline ULONGLONG IoHostFileHandle = FIRST_FREE_HANDLE;
+inline BOOLEAN IoInterruptEnabled = FALSE;
+inline BOOLEAN IoRingEnabled = FALSE;
 
 #ifdef __cplusplus
 extern "C" {
@@ -166,7 +208,14 @@ EXPORTNUM(324) DLLEXPORT extern XBOX_KRNL_VERSION XboxKrnlVersion;
 }
 #endif
 
+// Called at DISPATCH_LEVEL from the IDE dpc when an asynchronous I/O request is complete
+using PIO_HOST_COMPLETION_ROUTINE = VOID(XBOXAPI *)(IoInfoBlock InfoBlock, PVOID Context);
+
 IoInfoBlock SubmitIoRequestToHost(ULONG Type, LONGLONG OffsetOrInitialSize, ULONG Size, ULONGLONG HandleOrAddress, ULONGLONG HandleOrPath);
+BOOLEAN SubmitIoRequestToHostAsync(ULONG Type, LONGLONG OffsetOrInitialSize, ULONG Size, ULONGLONG HandleOrAddress, ULONGLONG HandleOrPath,
+	PIO_HOST_COMPLETION_ROUTINE CompletionRoutine, PVOID Context);
+VOID CompleteIoRequestsFromHost();
+VOID RegisterIoRingWithHost();
 ULONGLONG FASTCALL InterlockedIncrement64(volatile PULONGLONG Addend);
 NTSTATUS HostToNtStatus(IoStatus Status);
 VOID KeSetSystemTime(PLARGE_INTEGER NewTime, PLARGE_INTEGER OldTime);
@@ -279,3 +328,21 @@ static inline VOID CDECL atomic_add64(LONGLONG *dst, LONGLONG val)
 
 	__asm popfd
 }
+
+static inline VOID CDECL atomic_or32(ULONG *dst, ULONG val)
+{
+	__asm {
+		mov ecx, dst
+		mov eax, val
+		lock or [ecx], eax
+	}
+}
+
+static inline VOID CDECL atomic_and32(ULONG *dst, ULONG val)
+{
+	__asm {
+		mov ecx, dst
+		mov eax, val
+		lock and [ecx], eax
+	}
+}
@@ -142,11 +142,14 @@ void __declspec(naked) XBOXAPI KiTrap14()
 		mov edx, cr2
 		push edx
 		call MiPageFaultHandler
+		test al, al
+		jnz fault_resolved // the faulting instruction can be restarted
 		sti
 		mov eax, 0xC0000005 // STATUS_ACCESS_VIOLATION
 		mov ebx, [ebp]KTRAP_FRAME.Eip
 		CREATE_EXCEPTION_RECORD_ARG0;
 		HANDLE_EXCEPTION;
+	fault_resolved:
 		EXIT_EXCEPTION;
 	}
 }
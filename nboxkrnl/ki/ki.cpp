@@ -5,6 +5,7 @@
 #include "ki.hpp"
 #include "..\kernel.hpp"
 #include "rtl.hpp"
+#include "mi.hpp"
 
 
 KPCR KiPcr = { 0 };
@@ -58,5 +59,10 @@ VOID KiInitializeProcess(PKPROCESS Process, KPRIORITY BasePriority, LONG ThreadQ
 
 VOID KiIdleLoopThread()
 {
-	RIP_UNIMPLEMENTED();
+	while (true) {
+		// Use the idle time to zero the free pages, so that the page allocators don't have to do it. When there's nothing left to zero, halt until the next interrupt
+		if (MiZeroFreePage() == FALSE) {
+			__asm hlt
+		}
+	}
 }
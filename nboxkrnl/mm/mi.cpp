@@ -3,6 +3,7 @@
  */
 
 #include "mi.hpp"
+#include "fsc.hpp"
 #include "rtl.hpp"
 #include "dbg.hpp"
 #include <assert.h>
@@ -21,22 +22,283 @@ VOID MiFlushTlbForPage(PVOID Addr)
 	__asm invlpg Addr
 }
 
-PageType MiInsertPageInFreeListNoBusy(PFN_NUMBER Pfn)
+VOID MiQueueTlbFlush(PMMFLUSHBATCH Batch, PVOID Addr)
 {
-	assert(Pfn <= MiHighestPage);
+	if (Batch->Count < TLB_FLUSH_BATCH_SIZE) {
+		Batch->Addr[Batch->Count] = Addr;
+	}
 
-	PFN_COUNT ListIdx = GetPfnListIdx(Pfn);
-	USHORT EncodedPfn = EncodeFreePfn(Pfn);
-	PXBOX_PFN Pf = GetPfnElement(Pfn);
-	PageType BusyType = (PageType)Pf->Busy.BusyType;
-	PPFNREGION Region;
-	if (MiLayoutDevkit && (Pfn >= DEBUGKIT_FIRST_UPPER_HALF_PAGE)) {
-		Region = &MiDevkitRegion;
+	// Once the batch overflows, the addresses are no longer recorded since the entire tlb will be flushed anyway
+	if (Batch->Count <= TLB_FLUSH_BATCH_SIZE) {
+		++Batch->Count;
+	}
+}
+
+VOID MiFlushTlbBatch(PMMFLUSHBATCH Batch)
+{
+	if (Batch->Count > TLB_FLUSH_BATCH_SIZE) {
+		MiFlushEntireTlb();
 	}
 	else {
-		Region = &MiRetailRegion;
+		for (ULONG i = 0; i < Batch->Count; ++i) {
+			MiFlushTlbForPage(Batch->Addr[i]);
+		}
+	}
+
+	Batch->Count = 0;
+}
+
+// Calculates the free runs of the 32 entries tracked by a single ULONG of a bitmap
+static MMRUN MiCalculateWordRuns(ULONG Bits)
+{
+	if (Bits == 0xFFFFFFFF) {
+		return { RUN_BITMAP_BITS, RUN_BITMAP_BITS, RUN_BITMAP_BITS };
+	}
+
+	MMRUN Runs = { 0, 0, 0 };
+	while (Bits & (1 << Runs.Prefix)) {
+		++Runs.Prefix;
+	}
+	while (Bits & (0x80000000 >> Runs.Suffix)) {
+		++Runs.Suffix;
+	}
+	// Each iteration shortens all runs of set bits by one, so this stops after as many iterations as the length of the longest run
+	for (ULONG Ones = Bits; Ones; Ones &= (Ones << 1)) {
+		++Runs.Longest;
+	}
+
+	return Runs;
+}
+
+// Calculates the free runs of two adjacent ranges of entries, with the left one being at the lower indices
+static MMRUN MiCombineRuns(PMMRUN Left, ULONG SizeOfLeft, PMMRUN Right, ULONG SizeOfRight)
+{
+	MMRUN Runs;
+	Runs.Longest = Left->Suffix + Right->Prefix;
+	if (Left->Longest > Runs.Longest) {
+		Runs.Longest = Left->Longest;
+	}
+	if (Right->Longest > Runs.Longest) {
+		Runs.Longest = Right->Longest;
+	}
+	Runs.Prefix = (Left->Prefix == SizeOfLeft) ? (SizeOfLeft + Right->Prefix) : Left->Prefix;
+	Runs.Suffix = (Right->Suffix == SizeOfRight) ? (SizeOfRight + Left->Suffix) : Right->Suffix;
+
+	return Runs;
+}
+
+// Updates a leaf of a free run tree from the bitmap, and then all its ancestors up to the root
+static VOID MiUpdateRunTree(PMMRUNINDEX Index, ULONG LeafIdx)
+{
+	ULONG SizeOfLeaf = 1 << Index->LeafShift;
+	PULONG Bitmap = &Index->Bitmap[(LeafIdx << Index->LeafShift) / RUN_BITMAP_BITS];
+	MMRUN Runs = MiCalculateWordRuns(Bitmap[0]);
+	for (ULONG i = 1; i < (SizeOfLeaf / RUN_BITMAP_BITS); ++i) {
+		MMRUN WordRuns = MiCalculateWordRuns(Bitmap[i]);
+		Runs = MiCombineRuns(&Runs, i * RUN_BITMAP_BITS, &WordRuns, RUN_BITMAP_BITS);
+	}
+
+	PMMRUN RunTree = Index->RunTree;
+	ULONG Node = Index->NumberOfLeaves + LeafIdx;
+	RunTree[Node] = Runs;
+
+	for (ULONG SizeOfChild = SizeOfLeaf; Node > 1; SizeOfChild <<= 1) {
+		Node >>= 1;
+		RunTree[Node] = MiCombineRuns(&RunTree[Node << 1], SizeOfChild, &RunTree[(Node << 1) + 1], SizeOfChild);
+	}
+}
+
+// Marks a range of entries as free or in use in the bitmap of a free run index, and updates its tree accordingly
+static VOID MiUpdateRunIndex(PMMRUNINDEX Index, ULONG StartIdx, ULONG NumberOfEntries, BOOLEAN Free)
+{
+	ULONG FirstLeafIdx = StartIdx >> Index->LeafShift;
+	ULONG LastLeafIdx = (StartIdx + NumberOfEntries - 1) >> Index->LeafShift;
+
+	while (NumberOfEntries) {
+		ULONG Bit = StartIdx & (RUN_BITMAP_BITS - 1);
+		ULONG NumberOfBits = RUN_BITMAP_BITS - Bit;
+		if (NumberOfBits > NumberOfEntries) {
+			NumberOfBits = NumberOfEntries;
+		}
+
+		ULONG Mask = (NumberOfBits == RUN_BITMAP_BITS) ? 0xFFFFFFFF : (((1 << NumberOfBits) - 1) << Bit);
+		if (Free) {
+			assert((Index->Bitmap[StartIdx / RUN_BITMAP_BITS] & Mask) == 0);
+			Index->Bitmap[StartIdx / RUN_BITMAP_BITS] |= Mask;
+		}
+		else {
+			assert((Index->Bitmap[StartIdx / RUN_BITMAP_BITS] & Mask) == Mask);
+			Index->Bitmap[StartIdx / RUN_BITMAP_BITS] &= ~Mask;
+		}
+
+		StartIdx += NumberOfBits;
+		NumberOfEntries -= NumberOfBits;
+	}
+
+	for (ULONG LeafIdx = FirstLeafIdx; LeafIdx <= LastLeafIdx; ++LeafIdx) {
+		MiUpdateRunTree(Index, LeafIdx);
+	}
+}
+
+static BOOLEAN MiIsRunIndexEntryFree(PMMRUNINDEX Index, ULONG Idx)
+{
+	return (Index->Bitmap[Idx / RUN_BITMAP_BITS] & (1 << (Idx & (RUN_BITMAP_BITS - 1)))) != 0;
+}
+
+// Returns the index of the lowest run of at least NumberOfEntries free entries, or RUN_INDEX_NONE if there isn't one
+static ULONG MiFindLowestFreeRun(PMMRUNINDEX Index, ULONG NumberOfEntries)
+{
+	PMMRUN RunTree = Index->RunTree;
+	if (RunTree[1].Longest < NumberOfEntries) {
+		return RUN_INDEX_NONE;
+	}
+
+	// Descend the tree, preferring the left child to keep the allocations at the lowest indices. If neither child has a run large enough, then the run must be
+	// the one that crosses the boundary between the two
+	ULONG Node = 1, StartIdx = 0, SizeOfNode = Index->NumberOfLeaves << Index->LeafShift;
+	while (Node < Index->NumberOfLeaves) {
+		SizeOfNode >>= 1;
+		Node <<= 1;
+		if (RunTree[Node].Longest >= NumberOfEntries) {
+			continue;
+		}
+		if ((RunTree[Node].Suffix + RunTree[Node + 1].Prefix) >= NumberOfEntries) {
+			return StartIdx + SizeOfNode - RunTree[Node].Suffix;
+		}
+
+		++Node;
+		StartIdx += SizeOfNode;
+	}
+
+	// The run is inside the entries of this leaf, so find it in the bitmap
+	ULONG CurrRun = 0;
+	for (ULONG Idx = StartIdx; Idx < (StartIdx + SizeOfNode); ++Idx) {
+		if (MiIsRunIndexEntryFree(Index, Idx)) {
+			if (++CurrRun == NumberOfEntries) {
+				return Idx + 1 - NumberOfEntries;
+			}
+		}
+		else {
+			CurrRun = 0;
+		}
+	}
+
+	// The free run tree is out of sync with the bitmap
+	KeBugCheckLogEip(UNREACHABLE_CODE_REACHED);
+}
+
+// Returns the highest aligned start of NumberOfEntries entries inside the free run [RunStart, RunEnd), such that they are also inside [LowestIdx, HighestIdx]
+static ULONG MiFitFreeRun(ULONG RunStart, ULONG RunEnd, ULONG NumberOfEntries, ULONG LowestIdx, ULONG HighestIdx, ULONG Alignment)
+{
+	if (RunStart < LowestIdx) {
+		RunStart = LowestIdx;
+	}
+	if (RunEnd > (HighestIdx + 1)) {
+		RunEnd = HighestIdx + 1;
+	}
+	if ((RunEnd <= RunStart) || ((RunEnd - RunStart) < NumberOfEntries)) {
+		return RUN_INDEX_NONE;
+	}
+
+	ULONG StartIdx = ROUND_DOWN(RunEnd - NumberOfEntries, Alignment);
+	return (StartIdx >= RunStart) ? StartIdx : RUN_INDEX_NONE;
+}
+
+// Searches the subtree of Node for the highest aligned run of NumberOfEntries free entries inside [LowestIdx, HighestIdx]. Subtrees without a run large enough, or
+// without an aligned start for the run inside both their range and the limits, are skipped without visiting them. Runs that cross the boundary between two
+// children are checked by their parent instead. Because of this, the leaves that are scanned are only the ones that contain an aligned start, so a request with a
+// large alignment visits at most one leaf for each aligned start that is not free
+static ULONG MiFindHighestFreeRun(PMMRUNINDEX Index, ULONG Node, ULONG StartIdx, ULONG SizeOfNode, ULONG NumberOfEntries, ULONG LowestIdx, ULONG HighestIdx,
+	ULONG Alignment)
+{
+	PMMRUN RunTree = Index->RunTree;
+	if (RunTree[Node].Longest < NumberOfEntries) {
+		return RUN_INDEX_NONE;
+	}
+
+	ULONG FirstIdx = StartIdx > LowestIdx ? StartIdx : LowestIdx;
+	ULONG EndIdx = (StartIdx + SizeOfNode - 1) < HighestIdx ? (StartIdx + SizeOfNode) : (HighestIdx + 1);
+	if ((EndIdx <= FirstIdx) || ((EndIdx - FirstIdx) < NumberOfEntries) || (ROUND_DOWN(EndIdx - NumberOfEntries, Alignment) < FirstIdx)) {
+		return RUN_INDEX_NONE;
 	}
 
+	if (Node >= Index->NumberOfLeaves) {
+		// Scan the entries of this leaf from the top, a ULONG of the bitmap at a time when all its entries are either free or busy. Runs that continue into the
+		// adjacent leaves are clipped here, but they are also checked in full by the ancestor whose children boundary they cross
+		ULONG RunEnd = StartIdx + SizeOfNode;
+		for (ULONG WordIdx = StartIdx + SizeOfNode; WordIdx > StartIdx; WordIdx -= RUN_BITMAP_BITS) {
+			ULONG Bits = Index->Bitmap[(WordIdx - 1) / RUN_BITMAP_BITS];
+			if (Bits == 0xFFFFFFFF) {
+				continue;
+			}
+
+			if (Bits == 0) {
+				ULONG FoundIdx = MiFitFreeRun(WordIdx, RunEnd, NumberOfEntries, LowestIdx, HighestIdx, Alignment);
+				if (FoundIdx != RUN_INDEX_NONE) {
+					return FoundIdx;
+				}
+				RunEnd = WordIdx - RUN_BITMAP_BITS;
+				continue;
+			}
+
+			for (ULONG Idx = WordIdx; Idx > (WordIdx - RUN_BITMAP_BITS); --Idx) {
+				if (MiIsRunIndexEntryFree(Index, Idx - 1)) {
+					continue;
+				}
+
+				ULONG FoundIdx = MiFitFreeRun(Idx, RunEnd, NumberOfEntries, LowestIdx, HighestIdx, Alignment);
+				if (FoundIdx != RUN_INDEX_NONE) {
+					return FoundIdx;
+				}
+				RunEnd = Idx - 1;
+			}
+		}
+
+		return MiFitFreeRun(StartIdx, RunEnd, NumberOfEntries, LowestIdx, HighestIdx, Alignment);
+	}
+
+	SizeOfNode >>= 1;
+	ULONG FoundIdx = MiFindHighestFreeRun(Index, (Node << 1) + 1, StartIdx + SizeOfNode, SizeOfNode, NumberOfEntries, LowestIdx, HighestIdx, Alignment);
+	if (FoundIdx != RUN_INDEX_NONE) {
+		return FoundIdx;
+	}
+
+	ULONG Boundary = StartIdx + SizeOfNode;
+	FoundIdx = MiFitFreeRun(Boundary - RunTree[Node << 1].Suffix, Boundary + RunTree[(Node << 1) + 1].Prefix, NumberOfEntries, LowestIdx, HighestIdx, Alignment);
+	if (FoundIdx != RUN_INDEX_NONE) {
+		return FoundIdx;
+	}
+
+	return MiFindHighestFreeRun(Index, Node << 1, StartIdx, SizeOfNode, NumberOfEntries, LowestIdx, HighestIdx, Alignment);
+}
+
+ULONG MiFindContiguousPages(PFN_COUNT NumberOfPages, PFN_NUMBER LowestPfn, PFN_NUMBER HighestPfn, ULONG PfnAlignment)
+{
+	// NOTE: the retail pfn index is updated by MiInsertPageInFreeListNoBusy and MiRemovePageFromFreeList, so it always reflects the free lists of MiRetailRegion
+	return MiFindHighestFreeRun(&MiRetailPfnIndex, 1, 0, MiRetailPfnIndex.NumberOfLeaves << MiRetailPfnIndex.LeafShift, NumberOfPages, LowestPfn, HighestPfn,
+		PfnAlignment);
+}
+
+static PPFNREGION MiGetPfnRegion(PFN_NUMBER Pfn)
+{
+	if (MiLayoutDevkit && (Pfn >= DEBUGKIT_FIRST_UPPER_HALF_PAGE)) {
+		return &MiDevkitRegion;
+	}
+
+	return &MiRetailRegion;
+}
+
+static BOOLEAN MiIsPfnZeroed(PFN_NUMBER Pfn)
+{
+	return (MiZeroedPfnBitmap[Pfn / 32] & (1 << (Pfn & 31))) != 0;
+}
+
+static VOID MiLinkFreePfn(PPFNFREE ListHead, PFN_NUMBER Pfn)
+{
+	PFN_COUNT ListIdx = GetPfnListIdx(Pfn);
+	USHORT EncodedPfn = EncodeFreePfn(Pfn);
+	PXBOX_PFN Pf = GetPfnElement(Pfn);
+
 	/*
 	Performs a tail insertion from the list head
 	Before:
@@ -49,63 +311,39 @@ PageType MiInsertPageInFreeListNoBusy(PFN_NUMBER Pfn)
 	head f unchanged, b 3
 	*/
 
-	if (Region->FreeListHead[ListIdx].Flink != PFN_LIST_END) {
+	if (ListHead[ListIdx].Flink != PFN_LIST_END) {
 		Pf->Free.Flink = PFN_LIST_END;
-		Pf->Free.Blink = Region->FreeListHead[ListIdx].Blink;
-		USHORT PrevPfnIdx = DecodeFreePfn(Region->FreeListHead[ListIdx].Blink, ListIdx);
+		Pf->Free.Blink = ListHead[ListIdx].Blink;
+		USHORT PrevPfnIdx = DecodeFreePfn(ListHead[ListIdx].Blink, ListIdx);
 		PXBOX_PFN PrevPf = GetPfnElement(PrevPfnIdx);
 		PrevPf->Free.Flink = EncodedPfn;
-		Region->FreeListHead[ListIdx].Blink = EncodedPfn;
+		ListHead[ListIdx].Blink = EncodedPfn;
 
 		assert(GetPfnListIdx(PrevPfnIdx) == ListIdx);
 	}
 	else {
-		Region->FreeListHead[ListIdx].Flink = EncodedPfn;
-		Region->FreeListHead[ListIdx].Blink = EncodedPfn;
+		ListHead[ListIdx].Flink = EncodedPfn;
+		ListHead[ListIdx].Blink = EncodedPfn;
 		Pf->Free.Flink = PFN_LIST_END;
 		Pf->Free.Blink = PFN_LIST_END;
 	}
-
-	++Region->PagesAvailable;
-	++MiTotalPagesAvailable;
-
-	return BusyType;
 }
 
-VOID MiInsertPageInFreeList(PFN_NUMBER Pfn)
+static VOID MiUnlinkFreePfn(PPFNFREE ListHead, PFN_NUMBER Pfn)
 {
-	--MiPagesByUsage[MiInsertPageInFreeListNoBusy(Pfn)];
-}
-
-VOID MiInsertPageRangeInFreeListNoBusy(PFN_NUMBER Pfn, PFN_NUMBER PfnEnd)
-{
-	assert(Pfn <= PfnEnd);
-
-	for (PFN_NUMBER Pfn1 = Pfn; Pfn1 <= PfnEnd; ++Pfn1) {
-		MiInsertPageInFreeListNoBusy(Pfn1);
-	}
-}
-
-PXBOX_PFN MiRemovePageFromFreeList(PFN_NUMBER Pfn)
-{
-	assert(Pfn <= MiHighestPage);
-
 	PFN_COUNT ListIdx = GetPfnListIdx(Pfn);
 	PXBOX_PFN Pf = GetPfnElement(Pfn);
-	PPFNREGION Region;
-	if (MiLayoutDevkit && (Pfn >= DEBUGKIT_FIRST_UPPER_HALF_PAGE)) {
-		Region = &MiDevkitRegion;
-	}
-	else {
-		Region = &MiRetailRegion;
-	}
 
-	assert(Pf->Busy.Busy == 0);
+	if ((Pf->Free.Flink == PFN_LIST_END) && (Pf->Free.Blink == PFN_LIST_END)) {
+		// This is the only element, so the list becomes empty
 
-	if (Pf->Free.Flink == PFN_LIST_END) {
+		ListHead[ListIdx].Flink = PFN_LIST_END;
+		ListHead[ListIdx].Blink = PFN_LIST_END;
+	}
+	else if (Pf->Free.Flink == PFN_LIST_END) {
 		// This is the last element, so update Blink of head
 
-		Region->FreeListHead[ListIdx].Blink = Pf->Free.Blink;
+		ListHead[ListIdx].Blink = Pf->Free.Blink;
 		USHORT Blink = Pf->Free.Blink;
 		USHORT PrevPfnIdx = DecodeFreePfn(Blink, ListIdx);
 		PXBOX_PFN PrevPf = GetPfnElement(PrevPfnIdx);
@@ -116,7 +354,7 @@ PXBOX_PFN MiRemovePageFromFreeList(PFN_NUMBER Pfn)
 	else if (Pf->Free.Blink == PFN_LIST_END) {
 		// This is the first element, so update Flink of head
 
-		Region->FreeListHead[ListIdx].Flink = Pf->Free.Flink;
+		ListHead[ListIdx].Flink = Pf->Free.Flink;
 		USHORT Flink = Pf->Free.Flink;
 		USHORT NextPfnIdx = DecodeFreePfn(Flink, ListIdx);
 		PXBOX_PFN NextPf = GetPfnElement(NextPfnIdx);
@@ -139,10 +377,68 @@ PXBOX_PFN MiRemovePageFromFreeList(PFN_NUMBER Pfn)
 		assert(GetPfnListIdx(PrevPfnIdx) == ListIdx);
 		assert(GetPfnListIdx(NextPfnIdx) == ListIdx);
 	}
+}
+
+PageType MiInsertPageInFreeListNoBusy(PFN_NUMBER Pfn)
+{
+	assert(Pfn <= MiHighestPage);
+
+	PXBOX_PFN Pf = GetPfnElement(Pfn);
+	PageType BusyType = (PageType)Pf->Busy.BusyType;
+	PPFNREGION Region = MiGetPfnRegion(Pfn);
+
+	// The page still holds the data of its previous owner, so it goes in the dirty list until the idle thread zeroes it
+	MiLinkFreePfn(Region->FreeListHead, Pfn);
+
+	++Region->PagesAvailable;
+	++MiTotalPagesAvailable;
+
+	if (Region == &MiRetailRegion) {
+		MiUpdateRunIndex(&MiRetailPfnIndex, Pfn, 1, TRUE);
+	}
+
+	return BusyType;
+}
+
+VOID MiInsertPageInFreeList(PFN_NUMBER Pfn)
+{
+	--MiPagesByUsage[MiInsertPageInFreeListNoBusy(Pfn)];
+}
+
+VOID MiInsertPageRangeInFreeListNoBusy(PFN_NUMBER Pfn, PFN_NUMBER PfnEnd)
+{
+	assert(Pfn <= PfnEnd);
+
+	for (PFN_NUMBER Pfn1 = Pfn; Pfn1 <= PfnEnd; ++Pfn1) {
+		MiInsertPageInFreeListNoBusy(Pfn1);
+	}
+}
+
+PXBOX_PFN MiRemovePageFromFreeList(PFN_NUMBER Pfn)
+{
+	assert(Pfn <= MiHighestPage);
+
+	PXBOX_PFN Pf = GetPfnElement(Pfn);
+	PPFNREGION Region = MiGetPfnRegion(Pfn);
+
+	assert(Pf->Busy.Busy == 0);
+
+	if (MiIsPfnZeroed(Pfn)) {
+		MiUnlinkFreePfn(Region->ZeroedListHead, Pfn);
+		MiZeroedPfnBitmap[Pfn / 32] &= ~(1 << (Pfn & 31));
+		--Region->ZeroedPagesAvailable;
+	}
+	else {
+		MiUnlinkFreePfn(Region->FreeListHead, Pfn);
+	}
 
 	--Region->PagesAvailable;
 	--MiTotalPagesAvailable;
 
+	if (Region == &MiRetailRegion) {
+		MiUpdateRunIndex(&MiRetailPfnIndex, Pfn, 1, FALSE);
+	}
+
 	return Pf;
 }
 
@@ -169,6 +465,7 @@ VOID MiRemoveAndZeroPageFromFreeList(PFN_NUMBER Pfn, PageType BusyType, PMMPTE P
 
 	assert((BusyType != SystemPageTable) && (BusyType != VirtualPageTable));
 
+	BOOLEAN IsZeroed = MiIsPfnZeroed(Pfn);
 	PXBOX_PFN Pf = MiRemovePageFromFreeList(Pfn);
 	Pf->Busy.Busy = 1;
 	Pf->Busy.BusyType = BusyType;
@@ -179,8 +476,10 @@ VOID MiRemoveAndZeroPageFromFreeList(PFN_NUMBER Pfn, PageType BusyType, PMMPTE P
 	Pf = GetPfnOfPt(Pte);
 	++Pf->PtPageFrame.PtesUsed;
 
-	// Zero out the page
-	RtlFillMemoryUlong((PCHAR)GetVAddrMappedByPte(Pte), PAGE_SIZE, 0);
+	// Zero out the page, unless the idle thread already did it
+	if (!IsZeroed) {
+		RtlFillMemoryUlong((PCHAR)GetVAddrMappedByPte(Pte), PAGE_SIZE, 0);
+	}
 
 	++MiPagesByUsage[BusyType];
 }
@@ -191,15 +490,18 @@ VOID MiRemoveAndZeroPageTableFromFreeList(PFN_NUMBER Pfn, PageType BusyType, PMM
 
 	assert((BusyType == SystemPageTable) || (BusyType == VirtualPageTable));
 
+	BOOLEAN IsZeroed = MiIsPfnZeroed(Pfn);
 	PXBOX_PFN Pf = MiRemovePageFromFreeList(Pfn);
 	Pf->PtPageFrame.Busy = 1;
 	Pf->PtPageFrame.BusyType = BusyType;
 	Pf->PtPageFrame.LockCount = 0;
 	Pf->PtPageFrame.PtesUsed = 0;
 
-	// Zero out the page table
-	PCHAR PageTableAddr = (PCHAR)(PAGE_TABLES_BASE + ((((ULONG)Pde & PAGE_MASK) >> 2) << PAGE_SHIFT));
-	RtlFillMemoryUlong(PageTableAddr, PAGE_SIZE, 0);
+	// Zero out the page table, unless the idle thread already did it
+	if (!IsZeroed) {
+		PCHAR PageTableAddr = (PCHAR)(PAGE_TABLES_BASE + ((((ULONG)Pde & PAGE_MASK) >> 2) << PAGE_SHIFT));
+		RtlFillMemoryUlong(PageTableAddr, PAGE_SIZE, 0);
+	}
 
 	++MiPagesByUsage[BusyType];
 }
@@ -211,26 +513,40 @@ PFN_NUMBER MiRemovePageFromFreeList(PageType BusyType, PMMPTE Pte, PFN_COUNT(*Al
 	return Pfn;
 }
 
-PFN_NUMBER MiRemoveRetailPageFromFreeList()
+// Returns a free page of the region. When PreferZeroed is set, the pages already zeroed by the idle thread are returned first, otherwise they are returned last, so
+// that they are left to the allocations that need a zeroed page. The search starts from the list of the next color of the region
+static PFN_NUMBER MiFindFreePage(PPFNREGION Region, BOOLEAN PreferZeroed)
 {
-	for (PFN_COUNT ListIdx = 0; ListIdx < PFN_NUM_LISTS; ++ListIdx) {
-		if (MiRetailRegion.FreeListHead[ListIdx].Blink != PFN_LIST_END) {
-			return DecodeFreePfn(MiRetailRegion.FreeListHead[ListIdx].Blink, ListIdx);
+	PPFNFREE ListHeads[2] = { Region->FreeListHead, Region->ZeroedListHead };
+	for (ULONG i = 0; i < 2; ++i) {
+		PPFNFREE ListHead = ListHeads[PreferZeroed ? (1 - i) : i];
+		for (PFN_COUNT j = 0; j < PFN_NUM_LISTS; ++j) {
+			PFN_COUNT ListIdx = (Region->NextColor + j) & PFN_LIST_MASK;
+			if (ListHead[ListIdx].Blink != PFN_LIST_END) {
+				return DecodeFreePfn(ListHead[ListIdx].Blink, ListIdx);
+			}
 		}
 	}
 
 	RIP_API_MSG("should always find a free page.");
 }
 
-PFN_NUMBER MiRemoveDevkitPageFromFreeList()
+static PFN_NUMBER MiFindNextColorPage(PPFNREGION Region, BOOLEAN PreferZeroed)
 {
-	for (PFN_COUNT ListIdx = 0; ListIdx < PFN_NUM_LISTS; ++ListIdx) {
-		if (MiDevkitRegion.FreeListHead[ListIdx].Blink != PFN_LIST_END) {
-			return DecodeFreePfn(MiDevkitRegion.FreeListHead[ListIdx].Blink, ListIdx);
-		}
-	}
+	PFN_NUMBER Pfn = MiFindFreePage(Region, PreferZeroed);
+	Region->NextColor = (GetPfnListIdx(Pfn) + 1) & PFN_LIST_MASK;
 
-	RIP_API_MSG("should always find a free page.");
+	return Pfn;
+}
+
+PFN_NUMBER MiRemoveRetailPageFromFreeList()
+{
+	return MiFindNextColorPage(&MiRetailRegion, FALSE);
+}
+
+PFN_NUMBER MiRemoveDevkitPageFromFreeList()
+{
+	return MiFindNextColorPage(&MiDevkitRegion, FALSE);
 }
 
 PFN_NUMBER MiRemoveAnyPageFromFreeList()
@@ -238,10 +554,25 @@ PFN_NUMBER MiRemoveAnyPageFromFreeList()
 	// The caller should have already checked that we have enough free pages available
 	assert(MiTotalPagesAvailable);
 
-	MiRemoveRetailPageFromFreeList();
-	MiRemoveDevkitPageFromFreeList();
+	return MiRetailRegion.PagesAvailable ? MiRemoveRetailPageFromFreeList() : MiRemoveDevkitPageFromFreeList();
+}
+
+PFN_NUMBER MiRemoveRetailZeroedPageFromFreeList()
+{
+	return MiFindNextColorPage(&MiRetailRegion, TRUE);
+}
 
-	RIP_API_MSG("should always find a free page.");
+PFN_NUMBER MiRemoveDevkitZeroedPageFromFreeList()
+{
+	return MiFindNextColorPage(&MiDevkitRegion, TRUE);
+}
+
+PFN_NUMBER MiRemoveAnyZeroedPageFromFreeList()
+{
+	// The caller should have already checked that we have enough free pages available
+	assert(MiTotalPagesAvailable);
+
+	return MiRetailRegion.PagesAvailable ? MiRemoveRetailZeroedPageFromFreeList() : MiRemoveDevkitZeroedPageFromFreeList();
 }
 
 BOOLEAN MiConvertPageToPtePermissions(ULONG Protect, PMMPTE Pte)
@@ -348,77 +679,18 @@ static VOID MiReleasePtes(PPTEREGION PteRegion, PMMPTE StartPte, ULONG NumberOfP
 {
 	RtlFillMemoryUlong(StartPte, NumberOfPtes * sizeof(MMPTE), 0); // caller should flush the TLB if necessary
 
-	PMMPTE Pte = nullptr, LastPte = &PteRegion->Head;
-	while (LastPte->Free.Flink != PTE_LIST_END) {
-		Pte = PMMPTE(LastPte->Free.Flink << 2);
-		if (Pte > StartPte) {
-			break;
-		}
-
-		LastPte = Pte;
-	}
-
-	// Update Flink and size of StartPte assuming no merging with adjacent blocks
-	if (NumberOfPtes == 1) {
-		StartPte->Free.OnePte = 1;
-	}
-	else {
-		StartPte->Free.OnePte = 0;
-		StartPte[1].Free.Flink = NumberOfPtes;
-	}
-
-	StartPte->Free.Flink = LastPte->Free.Flink;
-	LastPte->Free.Flink = (ULONG)StartPte >> 2;
-
-	if ((StartPte + NumberOfPtes) == Pte) {
-		// Following block is contiguous with the one we are freeing, merge the two
-		// NOTE: StartPte[1] must be updated after StartPte. Otherwise, if NumberOfPtes=1, then StartPte[1] == Pte and writing to StartPte[1] first will corrupt Pte!
-		StartPte->Free.OnePte = 0;
-		StartPte->Free.Flink = Pte->Free.Flink;
-		StartPte[1].Free.Flink = (Pte->Free.OnePte ? 1 : Pte[1].Free.Flink) + NumberOfPtes;
-		NumberOfPtes = StartPte[1].Free.Flink;
-	}
-
-	if (LastPte != &PteRegion->Head) {
-		ULONG NumberOfPtesInBlock = LastPte->Free.OnePte ? 1 : LastPte[1].Free.Flink;
-
-		if (LastPte + NumberOfPtesInBlock == StartPte) {
-			// Previous block is contiguous with the one we are freeing, merge the two
-			LastPte->Free.OnePte = 0;
-			LastPte->Free.Flink = StartPte->Free.Flink;
-			LastPte[1].Free.Flink = NumberOfPtes + NumberOfPtesInBlock;
-		}
-	}
+	// NOTE: the freed ptes are merged with the adjacent free ptes, if any, because the bitmap doesn't track block boundaries
+	MiUpdateRunIndex(&PteRegion->FreePtes, StartPte - GetPteAddress(PteRegion->StartAddr), NumberOfPtes, TRUE);
 }
 
 static PMMPTE MiReservePtes(PPTEREGION PteRegion, ULONG NumberOfPtes)
 {
-	PMMPTE Pte = nullptr, LastPte = &PteRegion->Head;
-	while (LastPte->Free.Flink != PTE_LIST_END) {
-		Pte = PMMPTE(LastPte->Free.Flink << 2);
-		ULONG NumberOfPtesInBlock = Pte->Free.OnePte ? 1 : Pte[1].Free.Flink;
-		if (NumberOfPtesInBlock >= NumberOfPtes) {
-			// This block has enough ptes to satisfy the request
-			NumberOfPtesInBlock -= NumberOfPtes;
-			if (NumberOfPtesInBlock == 0) {
-				LastPte->Free.Flink = Pte->Free.Flink;
-			}
-			else if (NumberOfPtesInBlock == 1) {
-				Pte[NumberOfPtes].Free.OnePte = 1;
-				Pte[NumberOfPtes].Free.Flink = Pte->Free.Flink;
-				LastPte->Free.Flink = ULONG(Pte + NumberOfPtes) >> 2;
-			}
-			else {
-				Pte[NumberOfPtes].Free.OnePte = 0;
-				Pte[NumberOfPtes].Free.Flink = Pte->Free.Flink;
-				Pte[NumberOfPtes + 1].Free.Flink = NumberOfPtesInBlock;
-				LastPte->Free.Flink = ULONG(Pte + NumberOfPtes) >> 2;
-			}
+	ULONG StartIdx = MiFindLowestFreeRun(&PteRegion->FreePtes, NumberOfPtes);
+	if (StartIdx != RUN_INDEX_NONE) {
+		// This run has enough ptes to satisfy the request
+		MiUpdateRunIndex(&PteRegion->FreePtes, StartIdx, NumberOfPtes, FALSE);
 
-			return Pte;
-		}
-
-		LastPte = Pte;
+		return GetPteAddress(PteRegion->StartAddr) + StartIdx;
 	}
 
 	// If we reach here, it means that no pte block is large enough to satisfy the request, so we need to allocate new pts
@@ -434,7 +706,7 @@ static PMMPTE MiReservePtes(PPTEREGION PteRegion, ULONG NumberOfPtes)
 
 	ULONG Start4MiBlock = PteRegion->Next4MiBlock;
 	for (ULONG PtsCommitted = 0; PtsCommitted < NumberOfPts; ++PtsCommitted) {
-		PFN_NUMBER PtPfn = PteRegion->AllocationRoutine();
+		PFN_NUMBER PtPfn = PteRegion->ZeroedAllocationRoutine();
 		ULONG PtAddr = PtPfn << PAGE_SHIFT;
 		PMMPTE PtPde = GetPdeAddress(PteRegion->Next4MiBlock);
 
@@ -445,7 +717,7 @@ static PMMPTE MiReservePtes(PPTEREGION PteRegion, ULONG NumberOfPtes)
 		PteRegion->Next4MiBlock += MiB(4);
 	}
 
-	// Update the pte list to include the new free blocks created above
+	// Update the free pte bitmap to include the new free ptes created above
 	MiReleasePtes(PteRegion, GetPteAddress(Start4MiBlock), ROUND_UP(NumberOfPtes, PTE_PER_PAGE));
 	// It can't fail now
 	return MiReservePtes(PteRegion, NumberOfPtes);
@@ -473,6 +745,14 @@ PVOID MiAllocateSystemMemory(ULONG NumberOfBytes, ULONG Protect, PageType BusyTy
 		PteRegion = &MiDevkitPteRegion;
 	}
 
+	// Take back the pages of the cached kernel stacks and of the file system cache before failing, except when it's the cache itself that is growing
+	if ((NumberOfPages > *PteRegion->PagesAvailable) && (BusyType != Debugger)) {
+		MiReleaseKernelStackCache();
+	}
+	if ((NumberOfPages > *PteRegion->PagesAvailable) && (BusyType != Cache) && (BusyType != Debugger)) {
+		FscTrimCache(NumberOfPages - *PteRegion->PagesAvailable);
+	}
+
 	if (NumberOfPages > *PteRegion->PagesAvailable) {
 		MiUnlock(OldIrql);
 		return nullptr;
@@ -522,6 +802,9 @@ ULONG MiFreeSystemMemory(PVOID BaseAddress, ULONG NumberOfBytes)
 
 	KIRQL OldIrql = MiLock();
 
+	// NOTE: the freed pages are put in the free lists before their tlb entries are flushed. This is fine because nobody can allocate them until the mm lock is released
+	MMFLUSHBATCH FlushBatch;
+	FlushBatch.Count = 0;
 	ULONG NumberOfPages;
 	PMMPTE Pte = GetPteAddress(BaseAddress), StartPte = Pte;
 	if (NumberOfBytes) {
@@ -532,7 +815,7 @@ ULONG MiFreeSystemMemory(PVOID BaseAddress, ULONG NumberOfBytes)
 			if (Pte->Hw & PTE_VALID_MASK) {
 				PFN_NUMBER Pfn = Pte->Hw >> PAGE_SHIFT;
 				WriteZeroPte(Pte);
-				MiFlushTlbForPage((PVOID)GetVAddrMappedByPte(Pte));
+				MiQueueTlbFlush(&FlushBatch, (PVOID)GetVAddrMappedByPte(Pte));
 				MiInsertPageInFreeList(Pfn);
 				PXBOX_PFN Pf = GetPfnOfPt(Pte);
 				--Pf->PtPageFrame.PtesUsed;
@@ -549,7 +832,7 @@ ULONG MiFreeSystemMemory(PVOID BaseAddress, ULONG NumberOfBytes)
 			if (Pte->Hw & PTE_VALID_MASK) {
 				PFN_NUMBER Pfn = Pte->Hw >> PAGE_SHIFT;
 				WriteZeroPte(Pte);
-				MiFlushTlbForPage((PVOID)GetVAddrMappedByPte(Pte));
+				MiQueueTlbFlush(&FlushBatch, (PVOID)GetVAddrMappedByPte(Pte));
 				MiInsertPageInFreeList(Pfn);
 				PXBOX_PFN Pf = GetPfnOfPt(Pte);
 				--Pf->PtPageFrame.PtesUsed;
@@ -559,6 +842,7 @@ ULONG MiFreeSystemMemory(PVOID BaseAddress, ULONG NumberOfBytes)
 		}
 	}
 
+	MiFlushTlbBatch(&FlushBatch);
 	MiReleasePtes(IS_SYSTEM_ADDRESS(BaseAddress) ? &MiSystemPteRegion : &MiDevkitPteRegion, StartPte, NumberOfPages);
 
 	MiUnlock(OldIrql);
@@ -566,9 +850,159 @@ ULONG MiFreeSystemMemory(PVOID BaseAddress, ULONG NumberOfBytes)
 	return NumberOfPages;
 }
 
-VOID XBOXAPI MiPageFaultHandler(ULONG Cr2, ULONG Eip)
+VOID MiReleaseKernelStackCache()
+{
+	// Frees the kernel stacks kept by MmDeleteKernelStack. Called when an allocation runs short of pages, possibly with the mm lock already held
+	KIRQL OldIrql = MiLock();
+
+	for (ULONG i = 0; i < KERNEL_STACK_CACHE_DEPTH; ++i) {
+		if (MiKernelStackCache[i]) {
+			MiFreeSystemMemory((PCHAR)MiKernelStackCache[i] - KERNEL_STACK_SIZE - PAGE_SIZE, KERNEL_STACK_SIZE + PAGE_SIZE);
+			MiKernelStackCache[i] = nullptr;
+		}
+	}
+
+	MiUnlock(OldIrql);
+}
+
+static BOOLEAN MiHasDirtyFreePages(PPFNREGION Region)
+{
+	for (PFN_COUNT ListIdx = 0; ListIdx < PFN_NUM_LISTS; ++ListIdx) {
+		if (Region->FreeListHead[ListIdx].Flink != PFN_LIST_END) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+// Zeroes one page of the dirty free lists and moves it to the zeroed list of its region. Returns FALSE when there are no more pages to zero
+BOOLEAN MiZeroFreePage()
+{
+	KIRQL OldIrql = MiLock();
+
+	if (MiZeroingPte == nullptr) {
+		MiZeroingPte = MiReservePtes(&MiSystemPteRegion, 1);
+		if (MiZeroingPte == nullptr) {
+			MiUnlock(OldIrql);
+			return FALSE;
+		}
+	}
+
+	// NOTE: this can't compare PagesAvailable with ZeroedPagesAvailable, because the pages charged for demand zero ptes are not counted in the former
+	PPFNREGION Region;
+	if (MiHasDirtyFreePages(&MiRetailRegion)) {
+		Region = &MiRetailRegion;
+	}
+	else if (MiHasDirtyFreePages(&MiDevkitRegion)) {
+		Region = &MiDevkitRegion;
+	}
+	else {
+		MiUnlock(OldIrql);
+		return FALSE;
+	}
+
+	PFN_NUMBER Pfn = MiFindFreePage(Region, FALSE);
+
+	// Map the page with the zeroing pte, since free pages are not mapped anywhere else
+	WritePte(MiZeroingPte, ValidKernelPteBits | (Pfn << PAGE_SHIFT));
+	PVOID Addr = (PVOID)GetVAddrMappedByPte(MiZeroingPte);
+	MiFlushTlbForPage(Addr);
+	RtlFillMemoryUlong(Addr, PAGE_SIZE, 0);
+	WriteZeroPte(MiZeroingPte);
+	MiFlushTlbForPage(Addr);
+
+	MiUnlinkFreePfn(Region->FreeListHead, Pfn);
+	MiLinkFreePfn(Region->ZeroedListHead, Pfn);
+	MiZeroedPfnBitmap[Pfn / 32] |= (1 << (Pfn & 31));
+	++Region->ZeroedPagesAvailable;
+
+	MiUnlock(OldIrql);
+
+	return TRUE;
+}
+
+VOID MiChargeDemandZeroPages(PFN_COUNT NumberOfPages)
+{
+	// The caller should have already checked that we have enough free retail pages available
+	assert(NumberOfPages <= MiRetailRegion.PagesAvailable);
+
+	MiRetailRegion.PagesAvailable -= NumberOfPages;
+	MiTotalPagesAvailable -= NumberOfPages;
+	MiDemandZeroPagesCharged += NumberOfPages;
+}
+
+static VOID MiResolveDemandZeroPte(PMMPTE Pte)
 {
-	// For now, this just logs the faulting access and returns
+	// Give back the page charged when the pte was committed, and then take it from the free lists as usual
+	assert(MiDemandZeroPagesCharged);
+
+	--MiDemandZeroPagesCharged;
+	++MiRetailRegion.PagesAvailable;
+	++MiTotalPagesAvailable;
+
+	PageType BusyType = (PageType)(Pte->Hw >> PAGE_SHIFT);
+	PFN_NUMBER Pfn = MiRemoveRetailZeroedPageFromFreeList();
+	BOOLEAN IsZeroed = MiIsPfnZeroed(Pfn);
+	PXBOX_PFN Pf = MiRemovePageFromFreeList(Pfn);
+	Pf->Busy.Busy = 1;
+	Pf->Busy.BusyType = BusyType;
+	Pf->Busy.LockCount = 0;
+	Pf->Busy.PteIndex = GetPteOffset(GetVAddrMappedByPte(Pte));
+	++MiPagesByUsage[BusyType];
+	// NOTE: PtesUsed of the pt was already incremented when the pte was committed
+
+	// Use the same protection of the ptes that NtAllocateVirtualMemory commits eagerly
+	PVOID Addr = (PVOID)GetVAddrMappedByPte(Pte);
+	WritePte(Pte, ValidKernelPteBits | (Pfn << PAGE_SHIFT));
+	MiFlushTlbForPage(Addr);
+	if (!IsZeroed) {
+		RtlFillMemoryUlong(Addr, PAGE_SIZE, 0);
+	}
+}
 
+VOID MiMakeRangeResident(PVOID BaseAddress, ULONG NumberOfBytes)
+{
+	// Resolves the demand zero ptes of the range, because the host accesses the memory of an io request without going through the page fault handler
+	ULONG Addr = ROUND_DOWN_4K((ULONG)BaseAddress);
+	ULONG NumberOfPages = NumberOfBytes ? PAGES_SPANNED(BaseAddress, NumberOfBytes) : 0;
+
+	KIRQL OldIrql = MiLock();
+
+	for (ULONG i = 0; i < NumberOfPages; ++i, Addr += PAGE_SIZE) {
+		PMMPTE Pde = GetPdeAddress(Addr);
+		if ((Pde->Hw & (PTE_VALID_MASK | PTE_PAGE_LARGE_MASK)) == PTE_VALID_MASK) {
+			PMMPTE Pte = GetPteAddress(Addr);
+			if ((Pte->Hw & (PTE_VALID_MASK | PTE_DEMAND_ZERO_MASK)) == PTE_DEMAND_ZERO_MASK) {
+				MiResolveDemandZeroPte(Pte);
+			}
+		}
+	}
+
+	MiUnlock(OldIrql);
+}
+
+BOOLEAN XBOXAPI MiPageFaultHandler(ULONG Cr2, ULONG Eip)
+{
+	// Demand zero ptes are resolved here, by allocating their page. MiLock can only be taken at or below DISPATCH_LEVEL
+	if (KeGetCurrentIrql() <= DISPATCH_LEVEL) {
+		KIRQL OldIrql = MiLock();
+
+		PMMPTE Pde = GetPdeAddress(Cr2);
+		if ((Pde->Hw & (PTE_VALID_MASK | PTE_PAGE_LARGE_MASK)) == PTE_VALID_MASK) {
+			PMMPTE Pte = GetPteAddress(Cr2);
+			if ((Pte->Hw & (PTE_VALID_MASK | PTE_DEMAND_ZERO_MASK)) == PTE_DEMAND_ZERO_MASK) {
+				MiResolveDemandZeroPte(Pte);
+				MiUnlock(OldIrql);
+				return TRUE;
+			}
+		}
+
+		MiUnlock(OldIrql);
+	}
+
+	// For now, any other fault just logs the faulting access
 	DbgPrint("Page fault at 0x%X while touching address 0x%X", Eip, Cr2);
+
+	return FALSE;
 }
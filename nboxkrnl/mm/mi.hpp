@@ -21,6 +21,7 @@
 #define PTE_GLOBAL_MASK             0x00000100
 #define PTE_GUARD_END_MASK          0x00000200
 #define PTE_PERSIST_MASK            0x00000400
+#define PTE_DEMAND_ZERO_MASK        0x00000800 // only used by invalid ptes
 #define PTE_NOACCESS                0x00000000
 #define PTE_READONLY                PTE_VALID_MASK
 #define PTE_READWRITE               PTE_WRITE_MASK
@@ -29,13 +30,31 @@
 #define PTE_VALID_PROTECTION_MASK   0x0000021B // valid, write, write-through, no cache, guard/end
 #define PTE_SYSTEM_PROTECTION_MASK  0x0000001B // valid, write, write-through, no cache
 
-// Indicates that the system pte entry is not linked to other entries
-#define PTE_LIST_END (ULONG)0x3FFFFFFF
+// Indicates that no free run large enough was found in a free run index
+#define RUN_INDEX_NONE (ULONG)0xFFFFFFFF
+// Number of entries tracked by a single ULONG of the bitmap of a free run index
+#define RUN_BITMAP_BITS 32
+// Number of entries in a leaf of the free run tree of the system / devkit ptes (one pt) and of the retail pfns (1 MiB), expressed as a shift
+#define PTE_RUN_LEAF_SHIFT 10
+#define PFN_RUN_LEAF_SHIFT 8
+// Number of leaves of the free run trees of the system / devkit ptes and of the retail pfns
+#define SYSTEM_PTE_RUN_LEAVES (SYSTEM_MEMORY_SIZE / MiB(4))
+#define DEVKIT_PTE_RUN_LEAVES (DEVKIT_MEMORY_SIZE / MiB(4))
+#define PFN_RUN_LEAVES ((CHIHIRO_HIGHEST_PHYSICAL_PAGE + 1) >> PFN_RUN_LEAF_SHIFT)
+
+// Number of pages that a tlb flush batch invalidates one by one, above this the entire tlb is flushed instead
+#define TLB_FLUSH_BATCH_SIZE 16
+
+// Number of kernel stacks of terminated threads that are kept mapped for reuse by MmCreateKernelStack. Only stacks of KERNEL_STACK_SIZE bytes are kept
+#define KERNEL_STACK_CACHE_DEPTH 4
 
 // Indicates that the pfn entry is not linked to other entries
 #define PFN_LIST_END (USHORT)0x7FFF
-// Define how many free lists a pfn region has
-#define PFN_LIST_SHIFT 1
+// Define how many free lists a pfn region has. There is one list per page color, so that pages that map to different sets of the L2 cache are kept separate.
+// The xbox cpu has a 128 KiB 8-way L2, so 16 KiB per way and four page colors
+#ifndef PFN_LIST_SHIFT
+#define PFN_LIST_SHIFT 2
+#endif
 #define PFN_NUM_LISTS (1 << PFN_LIST_SHIFT)
 #define PFN_LIST_MASK (PFN_NUM_LISTS - 1)
 
@@ -43,23 +62,46 @@ using PFN = ULONG;
 using PFN_COUNT = ULONG;
 using PFN_NUMBER = ULONG;
 
-// NOTE: the size of a free pte block is stored in the free pte immediately following Free. If the size is only one, then this is signalled by OnePte instead
+// NOTE: free ptes in the system / devkit regions are zero, their state is tracked by the FreePtes index of their PTEREGION instead
 union MMPTE {
-	ULONG Hw;              // Used when the pte is valid
-	struct {
-		ULONG Present : 1; // must be clear or else the cpu will interpret the pte as valid
-		ULONG OnePte : 1;  // when set, the size of the current block is one pte
-		ULONG Flink : 30;  // virtual address to the next free pte block
-	} Free;
+	ULONG Hw;
 };
 using PMMPTE = MMPTE *;
 
+// Runs of free entries inside the range of entries covered by a node of a free run tree
+struct MMRUN {
+	ULONG Longest; // longest run of free entries in the range
+	ULONG Prefix;  // free entries at the start of the range
+	ULONG Suffix;  // free entries at the end of the range
+};
+using PMMRUN = MMRUN *;
+
+// NOTE: RunTree is a complete binary tree stored as an array, where node one is the root and the children of node n are 2n and 2n + 1. Each of its NumberOfLeaves
+// leaves covers (1 << LeafShift) entries, and a leaf is recalculated from the Bitmap only when one of its entries changes state. This allows to find a run of free
+// entries, and to update the tree after an allocation or a free, in logarithmic time. Adjacent free runs are implicitly coalesced, since they are just set bits in the bitmap
+struct MMRUNINDEX {
+	PULONG Bitmap; // one bit per entry, set when the entry is free
+	PMMRUN RunTree;
+	ULONG NumberOfLeaves;
+	ULONG LeafShift;
+};
+using PMMRUNINDEX = MMRUNINDEX *;
+
+// Pages whose translations must be invalidated. The flush is deferred until MiFlushTlbBatch, which must be called before the mm lock is released
+struct MMFLUSHBATCH {
+	ULONG Count;
+	PVOID Addr[TLB_FLUSH_BATCH_SIZE];
+};
+using PMMFLUSHBATCH = MMFLUSHBATCH *;
+
 struct PTEREGION {
-	MMPTE Head;
+	ULONG StartAddr;
 	ULONG Next4MiBlock;
 	ULONG EndAddr;
 	PFN_COUNT *PagesAvailable;
 	PFN_NUMBER(*AllocationRoutine)();
+	PFN_NUMBER(*ZeroedAllocationRoutine)();
+	MMRUNINDEX FreePtes;
 };
 using PPTEREGION = PTEREGION *;
 
@@ -74,6 +116,7 @@ struct PFNFREE {
 	USHORT Flink;
 	USHORT Blink;
 };
+using PPFNFREE = PFNFREE *;
 
 // PFN entry used by the memory manager
 union XBOX_PFN {
@@ -100,12 +143,27 @@ union XBOX_PFN {
 };
 using PXBOX_PFN = XBOX_PFN *;
 
+// NOTE: PagesAvailable counts the pages of both lists. The pages in ZeroedListHead have already been zeroed by the idle thread, and are also marked in MiZeroedPfnBitmap
 struct PFNREGION {
 	PFNFREE FreeListHead[PFN_NUM_LISTS];
 	PFN_COUNT PagesAvailable;
+	PFNFREE ZeroedListHead[PFN_NUM_LISTS];
+	PFN_COUNT ZeroedPagesAvailable;
+	PFN_COUNT NextColor; // color of the next page to allocate, advanced round-robin so that consecutive pages of an allocation don't alias in the L2
 };
 using PPFNREGION = PFNREGION *;
 
+consteval PFNREGION MiInitPfnRegion()
+{
+	PFNREGION Region = {};
+	for (PFN_COUNT ListIdx = 0; ListIdx < PFN_NUM_LISTS; ++ListIdx) {
+		Region.FreeListHead[ListIdx] = { PFN_LIST_END, PFN_LIST_END };
+		Region.ZeroedListHead[ListIdx] = { PFN_LIST_END, PFN_LIST_END };
+	}
+
+	return Region;
+}
+
 enum PageType {
 	Unknown,           // Used by the PFN database
 	Stack,             // Used by MmCreateKernelStack
@@ -122,7 +180,6 @@ enum PageType {
 };
 
 // Various macros to manipulate PDE/PTE/PFN
-#define GetPteBlockSize(Pte) (*((PULONG)(Pte) + 1))
 #define GetPdeAddress(Va) ((PMMPTE)(((((ULONG)(Va)) >> 22) << 2) + PAGE_DIRECTORY_BASE)) // (Va/4M) * 4 + PDE_BASE
 #define GetPteAddress(Va) ((PMMPTE)(((((ULONG)(Va)) >> 12) << 2) + PAGE_TABLES_BASE))    // (Va/4K) * 4 + PTE_BASE
 #define GetVAddrMappedByPte(Pte) ((ULONG)((ULONG_PTR)(Pte) << 10))
@@ -154,6 +211,8 @@ inline bool MiLayoutDevkit;
 
 PFN_NUMBER MiRemoveRetailPageFromFreeList();
 PFN_NUMBER MiRemoveDevkitPageFromFreeList();
+PFN_NUMBER MiRemoveRetailZeroedPageFromFreeList();
+PFN_NUMBER MiRemoveDevkitZeroedPageFromFreeList();
 
 // Highest pfn available for contiguous allocations
 inline PFN MiMaxContiguousPfn = XBOX_CONTIGUOUS_MEMORY_LIMIT;
@@ -168,13 +227,34 @@ inline PFN_COUNT MiPagesByUsage[Max] = { 0 };
 // Total physical free pages currently available (retail + devkit)
 inline PFN_COUNT MiTotalPagesAvailable = 0;
 // Tracks free pfns for retail / chihiro
-inline PFNREGION MiRetailRegion = { {{ PFN_LIST_END, PFN_LIST_END }, { PFN_LIST_END, PFN_LIST_END }}, 0 };
+inline PFNREGION MiRetailRegion = MiInitPfnRegion();
 // Tracks free pfns for the upper 64 MiB of a devkit
-inline PFNREGION MiDevkitRegion = { {{ PFN_LIST_END, PFN_LIST_END }, { PFN_LIST_END, PFN_LIST_END }}, 0 };
-// Tracks free pte blocks in the system region
-inline PTEREGION MiSystemPteRegion = { PTE_LIST_END << 2, SYSTEM_MEMORY_BASE, SYSTEM_MEMORY_END, &MiRetailRegion.PagesAvailable, MiRemoveRetailPageFromFreeList };
-// Tracks free pte blocks in the devkit region
-inline PTEREGION MiDevkitPteRegion = { PTE_LIST_END << 2, DEVKIT_MEMORY_BASE, DEVKIT_MEMORY_END, &MiDevkitRegion.PagesAvailable, MiRemoveDevkitPageFromFreeList };
+inline PFNREGION MiDevkitRegion = MiInitPfnRegion();
+// One bit per pfn, set when the free pfn is in the zeroed list of its region
+inline ULONG MiZeroedPfnBitmap[(CHIHIRO_HIGHEST_PHYSICAL_PAGE + 1) / 32] = { 0 };
+// Tops of the kernel stacks freed by MmDeleteKernelStack, which are still mapped together with their guard page. nullptr marks an unused entry
+inline PVOID MiKernelStackCache[KERNEL_STACK_CACHE_DEPTH] = { 0 };
+// System pte used by the idle thread to map the free pages it zeroes
+inline PMMPTE MiZeroingPte = nullptr;
+// Number of retail pages charged for demand zero ptes that were not touched yet. These are still in the free lists, but are not counted in PagesAvailable
+inline PFN_COUNT MiDemandZeroPagesCharged = 0;
+// Free pte bitmap and free pte tree of the system region
+inline ULONG MiSystemPteBitmap[(SYSTEM_PTE_RUN_LEAVES << PTE_RUN_LEAF_SHIFT) / RUN_BITMAP_BITS] = { 0 };
+inline MMRUN MiSystemPteRunTree[SYSTEM_PTE_RUN_LEAVES * 2] = { 0 };
+// Free pte bitmap and free pte tree of the devkit region
+inline ULONG MiDevkitPteBitmap[(DEVKIT_PTE_RUN_LEAVES << PTE_RUN_LEAF_SHIFT) / RUN_BITMAP_BITS] = { 0 };
+inline MMRUN MiDevkitPteRunTree[DEVKIT_PTE_RUN_LEAVES * 2] = { 0 };
+// Tracks free ptes in the system region
+inline PTEREGION MiSystemPteRegion = { SYSTEM_MEMORY_BASE, SYSTEM_MEMORY_BASE, SYSTEM_MEMORY_END, &MiRetailRegion.PagesAvailable, MiRemoveRetailPageFromFreeList,
+	MiRemoveRetailZeroedPageFromFreeList, { MiSystemPteBitmap, MiSystemPteRunTree, SYSTEM_PTE_RUN_LEAVES, PTE_RUN_LEAF_SHIFT } };
+// Tracks free ptes in the devkit region
+inline PTEREGION MiDevkitPteRegion = { DEVKIT_MEMORY_BASE, DEVKIT_MEMORY_BASE, DEVKIT_MEMORY_END, &MiDevkitRegion.PagesAvailable, MiRemoveDevkitPageFromFreeList,
+	MiRemoveDevkitZeroedPageFromFreeList, { MiDevkitPteBitmap, MiDevkitPteRunTree, DEVKIT_PTE_RUN_LEAVES, PTE_RUN_LEAF_SHIFT } };
+// Free pfn bitmap and free pfn tree of the retail region, used to find contiguous runs of free pages
+inline ULONG MiRetailPfnBitmap[(PFN_RUN_LEAVES << PFN_RUN_LEAF_SHIFT) / RUN_BITMAP_BITS] = { 0 };
+inline MMRUN MiRetailPfnRunTree[PFN_RUN_LEAVES * 2] = { 0 };
+// Tracks free pfns in the retail region by physical address
+inline MMRUNINDEX MiRetailPfnIndex = { MiRetailPfnBitmap, MiRetailPfnRunTree, PFN_RUN_LEAVES, PFN_RUN_LEAF_SHIFT };
 // Start address of the pfn database
 inline PCHAR MiPfnAddress = XBOX_PFN_ADDRESS;
 // Lock used to synchronize access to the VAD tree
@@ -189,6 +269,8 @@ inline ULONG MiVirtualMemoryBytesReserved = 0;
 
 VOID MiFlushEntireTlb();
 VOID MiFlushTlbForPage(PVOID Addr);
+VOID MiQueueTlbFlush(PMMFLUSHBATCH Batch, PVOID Addr);
+VOID MiFlushTlbBatch(PMMFLUSHBATCH Batch);
 VOID MiInsertPageInFreeList(PFN_NUMBER Pfn);
 PageType MiInsertPageInFreeListNoBusy(PFN_NUMBER Pfn);
 VOID MiInsertPageRangeInFreeListNoBusy(PFN_NUMBER Pfn, PFN_NUMBER PfnEnd);
@@ -198,8 +280,14 @@ VOID MiRemoveAndZeroPageTableFromFreeList(PFN_NUMBER Pfn, PageType BusyType, PMM
 VOID MiRemoveAndZeroPageFromFreeList(PFN_NUMBER Pfn, PageType BusyType, PMMPTE Pte);
 PFN_NUMBER MiRemovePageFromFreeList(PageType BusyType, PMMPTE Pte, PFN_COUNT(*AllocationRoutine)());
 PFN_NUMBER MiRemoveAnyPageFromFreeList();
+PFN_NUMBER MiRemoveAnyZeroedPageFromFreeList();
+ULONG MiFindContiguousPages(PFN_COUNT NumberOfPages, PFN_NUMBER LowestPfn, PFN_NUMBER HighestPfn, ULONG PfnAlignment);
 PVOID MiAllocateSystemMemory(ULONG NumberOfBytes, ULONG Protect, PageType BusyType, BOOLEAN AddGuardPage);
 ULONG MiFreeSystemMemory(PVOID BaseAddress, ULONG NumberOfBytes);
+VOID MiReleaseKernelStackCache();
+BOOLEAN MiZeroFreePage();
+VOID MiChargeDemandZeroPages(PFN_COUNT NumberOfPages);
+VOID MiMakeRangeResident(PVOID BaseAddress, ULONG NumberOfBytes);
 BOOLEAN MiConvertPageToPtePermissions(ULONG Protect, PMMPTE Pte);
 BOOLEAN MiConvertPageToSystemPtePermissions(ULONG Protect, PMMPTE Pte);
-VOID XBOXAPI MiPageFaultHandler(ULONG Cr2, ULONG Eip);
+BOOLEAN XBOXAPI MiPageFaultHandler(ULONG Cr2, ULONG Eip);
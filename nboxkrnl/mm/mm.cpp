@@ -257,11 +257,53 @@ BOOLEAN MmInitSystem()
 		return FALSE;
 	}
 
-	MiLastFree = GetVADNode(LOWEST_USER_ADDRESS);
-
 	return TRUE;
 }
 
+// Maps a contiguous allocation made of whole 4 MiB blocks with large pages, so that it doesn't need pts and uses a single tlb entry per block. The pts left in the
+// blocks by previous allocations are freed, since all their ptes are unused if the pages they mapped are free
+static PVOID MiMapContiguousLargePages(PFN_NUMBER StartPfn, PFN_COUNT NumberOfPages, ULONG PdeProtection)
+{
+	BOOLEAN FlushTlb = FALSE;
+	PFN_NUMBER Pfn = StartPfn;
+	PMMPTE Pde = GetPdeAddress(ConvertPfnToContiguous(StartPfn));
+	PMMPTE PdeEnd = Pde + (NumberOfPages / PTE_PER_PAGE) - 1;
+
+	while (Pde <= PdeEnd) {
+		if (Pde->Hw & PTE_VALID_MASK) {
+			assert((Pde->Hw & PTE_PAGE_LARGE_MASK) == 0);
+
+			PFN_NUMBER PtPfn = GetPfnFromContiguous(Pde->Hw);
+			assert(GetPfnElement(PtPfn)->PtPageFrame.PtesUsed == 0);
+			WriteZeroPte(Pde);
+			MiInsertPageInFreeList(PtPfn);
+			FlushTlb = TRUE;
+		}
+
+		// NOTE: this cannot use the overload MiRemovePageFromFreeList that updates PtesUsed, because there's no pt for these pages
+		for (ULONG PteIndex = 0; PteIndex < PTE_PER_PAGE; ++PteIndex) {
+			PXBOX_PFN Pf = MiRemovePageFromFreeList(Pfn + PteIndex);
+			Pf->Busy.Busy = 1;
+			Pf->Busy.BusyType = Contiguous;
+			Pf->Busy.LockCount = 0;
+			Pf->Busy.PteIndex = PteIndex;
+		}
+		MiPagesByUsage[Contiguous] += PTE_PER_PAGE;
+
+		WritePte(Pde, PdeProtection | PTE_PAGE_LARGE_MASK | (Pfn << PAGE_SHIFT));
+		Pfn += PTE_PER_PAGE;
+		++Pde;
+	}
+	PdeEnd->Hw |= PTE_GUARD_END_MASK;
+
+	if (FlushTlb) {
+		// Also flush the cached pdes of the pts that were freed above
+		MiFlushEntireTlb();
+	}
+
+	return ConvertPfnToContiguous(StartPfn);
+}
+
 EXPORTNUM(165) PVOID XBOXAPI MmAllocateContiguousMemory
 (
 	ULONG NumberOfBytes
@@ -300,53 +342,59 @@ EXPORTNUM(166) PVOID XBOXAPI MmAllocateContiguousMemoryEx
 		return nullptr;
 	}
 
-	ULONG CurrentPfn = ROUND_DOWN(HighestPfn, PfnAlignment), FoundPages = 0;
-	do {
-		PXBOX_PFN Pf = GetPfnElement(CurrentPfn);
-		if (Pf->Busy.Busy) {
-			FoundPages = 0;
-			CurrentPfn = ROUND_DOWN(CurrentPfn - 1, PfnAlignment);
-			continue;
+	if ((NumberOfPages & (PTE_PER_PAGE - 1)) == 0) {
+		// The allocation is made of whole 4 MiB blocks, so try to map it with large pages. This requires a run aligned to 4 MiB
+		ULONG LargePfn = MiFindContiguousPages(NumberOfPages, LowestPfn, HighestPfn, (PfnAlignment > PTE_PER_PAGE) ? PfnAlignment : PTE_PER_PAGE);
+		if (LargePfn != RUN_INDEX_NONE) {
+			PVOID Addr = MiMapContiguousLargePages(LargePfn, NumberOfPages, TempPte.Hw);
+			MiUnlock(OldIrql);
+			return Addr;
 		}
+	}
 
-		++FoundPages;
-		if (FoundPages == NumberOfPages) {
-			break;
+	ULONG CurrentPfn;
+	PMMPTE Pte, StartPte, PteEnd;
+	while (true) {
+		CurrentPfn = MiFindContiguousPages(NumberOfPages, LowestPfn, HighestPfn, PfnAlignment);
+		if (CurrentPfn == RUN_INDEX_NONE) {
+			MiUnlock(OldIrql);
+			return nullptr;
 		}
 
-		--CurrentPfn;
-	} while ((LONG)CurrentPfn >= (LONG)LowestPfn);
+		ULONG NumberOfPts = 0;
+		StartPte = GetPteAddress(CONTIGUOUS_MEMORY_BASE + (CurrentPfn << PAGE_SHIFT));
+		PteEnd = StartPte + NumberOfPages - 1;
+		for (Pte = StartPte; Pte <= PteEnd; Pte = PMMPTE((PCHAR)Pte + PAGE_SIZE)) {
+			PMMPTE Pde = GetPteAddress(Pte);
+			if ((Pde->Hw & PTE_VALID_MASK) == 0) {
+				++NumberOfPts;
+			}
+		}
 
-	if (FoundPages != NumberOfPages) {
-		MiUnlock(OldIrql);
-		return nullptr;
-	}
+		if (NumberOfPts == 0) {
+			break;
+		}
 
-	PMMPTE Pte = GetPteAddress(CONTIGUOUS_MEMORY_BASE + (CurrentPfn << PAGE_SHIFT)), StartPte = Pte, PteEnd = Pte + NumberOfPages - 1;
-	while (Pte <= PteEnd) {
-		PMMPTE Pde = GetPteAddress(Pte);
-		if ((Pde->Hw & PTE_VALID_MASK) == 0) {
-			++NumberOfPages;
+		if ((NumberOfPages + NumberOfPts) > MiRetailRegion.PagesAvailable) {
+			MiUnlock(OldIrql);
+			return nullptr;
 		}
-		Pte = PMMPTE((PCHAR)Pte + PAGE_SIZE);
-	}
 
-	if (NumberOfPages > MiRetailRegion.PagesAvailable) {
-		MiUnlock(OldIrql);
-		return nullptr;
+		// The pages of the missing pts could be taken from the run we just found, so commit the pts first and then search again
+		for (Pte = StartPte; Pte <= PteEnd; ++Pte) {
+			if ((Pte == StartPte) || IsPteOnPdeBoundary(Pte)) {
+				PMMPTE Pde = GetPteAddress(Pte);
+				if ((Pde->Hw & PTE_VALID_MASK) == 0) {
+					PFN_NUMBER PageTablePfn = MiRemoveRetailZeroedPageFromFreeList();
+					WritePte(Pde, ValidKernelPdeBits | SetPfn(ConvertPfnToContiguous(PageTablePfn)));
+					MiRemoveAndZeroPageTableFromFreeList(PageTablePfn, VirtualPageTable, Pde);
+				}
+			}
+		}
 	}
 
 	Pte = StartPte;
 	while (Pte <= PteEnd) {
-		if ((Pte == StartPte) || IsPteOnPdeBoundary(Pte)) {
-			PMMPTE Pde = GetPteAddress(Pte);
-			if ((Pde->Hw & PTE_VALID_MASK) == 0) {
-				PFN_NUMBER PageTablePfn = MiRemoveRetailPageFromFreeList();
-				WritePte(Pde, ValidKernelPdeBits | SetPfn(ConvertPfnToContiguous(PageTablePfn)));
-				MiRemoveAndZeroPageTableFromFreeList(PageTablePfn, VirtualPageTable, Pde);
-			}
-		}
-
 		MiRemovePageFromFreeList(CurrentPfn, Contiguous, Pte);
 		WritePte(Pte, TempPte.Hw | ((CurrentPfn << PAGE_SHIFT) + CONTIGUOUS_MEMORY_BASE));
 		++CurrentPfn;
@@ -393,6 +441,8 @@ EXPORTNUM(168) PVOID XBOXAPI MmClaimGpuInstanceMemory
 		// This check is necessary because some games (e.g. Halo) call this twice but they provide the same size, meaning that we don't need
 		// to change anything
 		if (NumberOfBytes != MiNV2AInstanceMemoryBytes) {
+			MMFLUSHBATCH FlushBatch;
+			FlushBatch.Count = 0;
 			PFN Pfn = MiNV2AInstancePage + NV2A_INSTANCE_PAGE_COUNT - (ROUND_UP_4K(MiNV2AInstanceMemoryBytes) >> PAGE_SHIFT);
 			PFN PfnEnd = MiNV2AInstancePage + NV2A_INSTANCE_PAGE_COUNT - (NumberOfBytes >> PAGE_SHIFT) - 1;
 			PMMPTE Pte = GetPteAddress(ConvertPfnToContiguous(Pfn));
@@ -405,7 +455,7 @@ EXPORTNUM(168) PVOID XBOXAPI MmClaimGpuInstanceMemory
 				assert(Pte->Hw & PTE_VALID_MASK);
 				PFN_NUMBER CurrentPfn = GetPfnFromContiguous(Pte->Hw);
 				WriteZeroPte(Pte);
-				MiFlushTlbForPage((PVOID)GetVAddrMappedByPte(Pte));
+				MiQueueTlbFlush(&FlushBatch, (PVOID)GetVAddrMappedByPte(Pte));
 				MiInsertPageInFreeList(CurrentPfn);
 				PXBOX_PFN Pf = GetPfnOfPt(Pte);
 				--Pf->PtPageFrame.PtesUsed;
@@ -425,7 +475,7 @@ EXPORTNUM(168) PVOID XBOXAPI MmClaimGpuInstanceMemory
 					assert(Pte->Hw & PTE_VALID_MASK);
 					PFN_NUMBER CurrentPfn = GetPfnFromContiguous(Pte->Hw);
 					WriteZeroPte(Pte);
-					MiFlushTlbForPage((PVOID)GetVAddrMappedByPte(Pte));
+					MiQueueTlbFlush(&FlushBatch, (PVOID)GetVAddrMappedByPte(Pte));
 					MiInsertPageInFreeList(CurrentPfn);
 					PXBOX_PFN Pf = GetPfnOfPt(Pte);
 					--Pf->PtPageFrame.PtesUsed;
@@ -434,12 +484,13 @@ EXPORTNUM(168) PVOID XBOXAPI MmClaimGpuInstanceMemory
 						PMMPTE Pde = GetPteAddress(Pte);
 						PFN_NUMBER PtPfn = GetPfnFromContiguous(Pde->Hw);
 						WriteZeroPte(Pde);
-						MiFlushTlbForPage((PVOID)GetVAddrMappedByPte(Pde));
+						MiQueueTlbFlush(&FlushBatch, (PVOID)GetVAddrMappedByPte(Pde));
 						MiInsertPageInFreeList(PtPfn);
 					}
 					++Pte;
 				}
 			}
+			MiFlushTlbBatch(&FlushBatch);
 			MiNV2AInstanceMemoryBytes = NumberOfBytes;
 		}
 
@@ -455,6 +506,29 @@ EXPORTNUM(169) PVOID XBOXAPI MmCreateKernelStack
 	BOOLEAN DebuggerThread
 )
 {
+	if ((DebuggerThread == FALSE) && (ROUND_UP_4K(NumberOfBytes) == KERNEL_STACK_SIZE)) {
+		PVOID StackBase = nullptr;
+
+		KIRQL OldIrql = MiLock();
+
+		for (ULONG i = 0; i < KERNEL_STACK_CACHE_DEPTH; ++i) {
+			if (MiKernelStackCache[i]) {
+				StackBase = MiKernelStackCache[i];
+				MiKernelStackCache[i] = nullptr;
+				break;
+			}
+		}
+
+		MiUnlock(OldIrql);
+
+		if (StackBase) {
+			// The stack was taken from the cache, so it's already mapped. It's zeroed here instead of when it was freed, so that the
+			// termination dpc doesn't pay for it
+			RtlFillMemoryUlong((PCHAR)StackBase - KERNEL_STACK_SIZE, KERNEL_STACK_SIZE, 0);
+			return StackBase;
+		}
+	}
+
 	return MiAllocateSystemMemory(NumberOfBytes, PAGE_READWRITE, DebuggerThread ? Debugger : Stack, TRUE);
 }
 
@@ -464,6 +538,22 @@ EXPORTNUM(170) VOID XBOXAPI MmDeleteKernelStack
 	PVOID StackLimit
 )
 {
+	// Only cache the stacks of the default size of the system region, since the ones of the debugger threads live in the devkit region. This way, the pages
+	// that the cache can hold are bounded, and MiReleaseKernelStackCache knows the size of every cached stack
+	if (IS_SYSTEM_ADDRESS(StackLimit) && (((ULONG_PTR)StackBase - (ULONG_PTR)StackLimit) == KERNEL_STACK_SIZE)) {
+		KIRQL OldIrql = MiLock();
+
+		for (ULONG i = 0; i < KERNEL_STACK_CACHE_DEPTH; ++i) {
+			if (MiKernelStackCache[i] == nullptr) {
+				MiKernelStackCache[i] = StackBase;
+				MiUnlock(OldIrql);
+				return;
+			}
+		}
+
+		MiUnlock(OldIrql);
+	}
+
 	ULONG StackSize = (ULONG_PTR)StackBase - (ULONG_PTR)StackLimit + PAGE_SIZE;
 	PVOID StackBottom = (PVOID)((ULONG_PTR)StackBase - StackSize);
 	MiFreeSystemMemory(StackBottom, StackSize);
@@ -491,6 +581,15 @@ EXPORTNUM(180) SIZE_T XBOXAPI MmQueryAllocationSize
 	PMMPTE Pte = GetPteAddress(BaseAddress);
 
 	while (!Stop) {
+		PMMPTE Pde = GetPteAddress(Pte);
+		if (Pde->Hw & PTE_PAGE_LARGE_MASK) {
+			// Large pages have no pt, so the end marker is in the pde instead
+			Stop = Pde->Hw & PTE_GUARD_END_MASK;
+			Pte += PTE_PER_PAGE;
+			NumberOfPages += PTE_PER_PAGE;
+			continue;
+		}
+
 		Stop = Pte->Hw & PTE_GUARD_END_MASK;
 		++Pte;
 		++NumberOfPages;
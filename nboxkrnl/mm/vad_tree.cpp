@@ -6,6 +6,61 @@
 #include "ex.hpp"
 #include <assert.h>
 
+// Number of nodes allocated from the pool at once when the vad node cache is empty
+#define VAD_NODES_PER_SLAB 32
+// Carving a vad splits it at most twice, so keeping this many nodes cached guarantees that the splits can't fail
+#define VAD_NODE_RESERVE 2
+
+
+// Cache of unused vad nodes, linked through m_Left. Nodes are never returned to the pool, so that allocations and frees done
+// by splits and merges don't go through the general pool. Protected by MiVadLock
+static VAD_NODE *MiVadNodeCache = nullptr;
+static ULONG MiVadNodesCached = 0;
+
+static BOOLEAN GrowVADNodeCache()
+{
+	VAD_NODE *Slab = (VAD_NODE *)ExAllocatePoolWithTag(sizeof(VAD_NODE) * VAD_NODES_PER_SLAB, 'daVM');
+	if (Slab == nullptr) {
+		return FALSE;
+	}
+
+	for (ULONG i = 0; i < VAD_NODES_PER_SLAB; ++i) {
+		Slab[i].m_Left = MiVadNodeCache;
+		MiVadNodeCache = &Slab[i];
+	}
+	MiVadNodesCached += VAD_NODES_PER_SLAB;
+
+	return TRUE;
+}
+
+static BOOLEAN ReserveVADNodes()
+{
+	if (MiVadNodesCached < VAD_NODE_RESERVE) {
+		return GrowVADNodeCache();
+	}
+
+	return TRUE;
+}
+
+static VAD_NODE *AllocateVADNode()
+{
+	if ((MiVadNodeCache == nullptr) && (GrowVADNodeCache() == FALSE)) {
+		return nullptr;
+	}
+
+	VAD_NODE *Node = MiVadNodeCache;
+	MiVadNodeCache = Node->m_Left;
+	--MiVadNodesCached;
+
+	return Node;
+}
+
+static VOID FreeVADNode(VAD_NODE *Node)
+{
+	Node->m_Left = MiVadNodeCache;
+	MiVadNodeCache = Node;
+	++MiVadNodesCached;
+}
 
 BOOLEAN VAD::CanBeMergedWith(const VAD &Next) const
 {
@@ -26,6 +81,7 @@ VOID VAD_NODE::Init(ULONG Start, ULONG Size, VAD_TYPE Type, ULONG Protect)
 	m_Vad.m_Protect = Protect;
 	m_Height = 0;
 	m_Left = m_Right = nullptr;
+	m_MaxFree = 0;
 }
 
 int VAD_NODE::Compare(ULONG Start)
@@ -49,6 +105,35 @@ static int CalcHeight(VAD_NODE *Node)
 	return (HeightL > HeightR ? HeightL : HeightR) + 1;
 }
 
+static ULONG CalcFreeSize(const VAD &Vad, ULONG HighestAddress)
+{
+	if (Vad.m_Type != Free) {
+		return 0;
+	}
+
+	// Allocations are always aligned to the xbox granularity, so only count the space after the first 64 KiB boundary
+	ULONG Start = ROUND_UP(Vad.m_Start, X64K);
+	ULONG End = Vad.m_Start + Vad.m_Size;
+	if (End > (HighestAddress + 1)) {
+		End = HighestAddress + 1;
+	}
+
+	return End > Start ? End - Start : 0;
+}
+
+static ULONG CalcMaxFree(VAD_NODE *Node)
+{
+	ULONG MaxFree = CalcFreeSize(Node->m_Vad, HIGHEST_USER_ADDRESS);
+	if (Node->m_Left && (Node->m_Left->m_MaxFree > MaxFree)) {
+		MaxFree = Node->m_Left->m_MaxFree;
+	}
+	if (Node->m_Right && (Node->m_Right->m_MaxFree > MaxFree)) {
+		MaxFree = Node->m_Right->m_MaxFree;
+	}
+
+	return MaxFree;
+}
+
 static int CalcBalance(VAD_NODE *Node)
 {
 	int HeightL = Node->m_Left ? Node->m_Left->m_Height : -1;
@@ -66,6 +151,8 @@ static VAD_NODE *RotateL(VAD_NODE *Node)
 
 	Node->m_Height = CalcHeight(Node);
 	NodeR->m_Height = CalcHeight(NodeR);
+	Node->m_MaxFree = CalcMaxFree(Node);
+	NodeR->m_MaxFree = CalcMaxFree(NodeR);
 
 	return NodeR;
 }
@@ -79,6 +166,8 @@ static VAD_NODE *RotateR(VAD_NODE *Node)
 
 	Node->m_Height = CalcHeight(Node);
 	NodeL->m_Height = CalcHeight(NodeL);
+	Node->m_MaxFree = CalcMaxFree(Node);
+	NodeL->m_MaxFree = CalcMaxFree(NodeL);
 
 	return NodeL;
 }
@@ -100,13 +189,13 @@ static VOID ReplaceParent(VAD_NODE *Parent, VAD_NODE *Child)
 	if (Parent->m_Left == Child) {
 		Parent->m_Start = Child->m_Start;
 		Parent->m_Vad = Child->m_Vad;
-		ExFreePool(Child);
+		FreeVADNode(Child);
 		Parent->m_Left = nullptr;
 	}
 	else if (Parent->m_Right == Child) {
 		Parent->m_Start = Child->m_Start;
 		Parent->m_Vad = Child->m_Vad;
-		ExFreePool(Child);
+		FreeVADNode(Child);
 		Parent->m_Right = nullptr;
 	}
 }
@@ -114,11 +203,12 @@ static VOID ReplaceParent(VAD_NODE *Parent, VAD_NODE *Child)
 static VAD_NODE *InsertVADNode(VAD_NODE *Node, ULONG Start, ULONG Size, VAD_TYPE Type, ULONG Protect, VAD_NODE **InsertedNode)
 {
 	if (Node == nullptr) {
-		Node = (VAD_NODE *)ExAllocatePool(sizeof(VAD_NODE));
+		Node = AllocateVADNode();
 		if (Node == nullptr) {
 			ExRaiseStatus(STATUS_NO_MEMORY);
 		}
 		Node->Init(Start, Size, Type, Protect);
+		Node->m_MaxFree = CalcMaxFree(Node);
 		if (InsertedNode) {
 			*InsertedNode = Node;
 		}
@@ -135,6 +225,7 @@ static VAD_NODE *InsertVADNode(VAD_NODE *Node, ULONG Start, ULONG Size, VAD_TYPE
 		Node->m_Vad.m_Size = Size;
 		Node->m_Vad.m_Type = Type;
 		Node->m_Vad.m_Protect = Protect;
+		Node->m_MaxFree = CalcMaxFree(Node);
 		if (InsertedNode) {
 			*InsertedNode = Node;
 		}
@@ -145,6 +236,7 @@ static VAD_NODE *InsertVADNode(VAD_NODE *Node, ULONG Start, ULONG Size, VAD_TYPE
 	}
 
 	Node->m_Height = CalcHeight(Node);
+	Node->m_MaxFree = CalcMaxFree(Node);
 
 	int Balance = CalcBalance(Node);
 
@@ -187,6 +279,7 @@ static VAD_NODE *EraseVADNode(VAD_NODE *Node, ULONG Start)
 				Node1 = Node1->m_Left;
 			}
 			Node->m_Start = Node1->m_Start;
+			Node->m_Vad = Node1->m_Vad;
 			Node->m_Right = EraseVADNode(Node->m_Right, Node1->m_Start);
 		}
 		else if (Node->m_Left) {
@@ -196,13 +289,14 @@ static VAD_NODE *EraseVADNode(VAD_NODE *Node, ULONG Start)
 			ReplaceParent(Node, Node->m_Right);
 		}
 		else {
-			ExFreePool(Node);
+			FreeVADNode(Node);
 			Node = nullptr;
 		}
 	}
 
 	if (Node != nullptr) {
 		Node->m_Height = CalcHeight(Node);
+		Node->m_MaxFree = CalcMaxFree(Node);
 
 		int balance = CalcBalance(Node);
 
@@ -226,6 +320,29 @@ static VAD_NODE *EraseVADNode(VAD_NODE *Node, ULONG Start)
 	return Node;
 }
 
+static VOID UpdateVADPath(VAD_NODE *Node, ULONG Start)
+{
+	if (Node == nullptr) {
+		return;
+	}
+
+	int Ret = Node->Compare(Start);
+	if (Ret < 0) {
+		UpdateVADPath(Node->m_Right, Start);
+	}
+	else if (Ret > 0) {
+		UpdateVADPath(Node->m_Left, Start);
+	}
+
+	Node->m_MaxFree = CalcMaxFree(Node);
+}
+
+static VOID UpdateVADPath(ULONG Start)
+{
+	// Must be called after the size or type of a vad was changed in place, so that the free gaps cached by its ancestors stay correct
+	UpdateVADPath(MiVadRoot, Start);
+}
+
 VAD_NODE *GetNextVAD(VAD_NODE *Node)
 {
 	if (Node == nullptr) {
@@ -309,6 +426,7 @@ static VAD_NODE *SplitVAD(VAD_NODE *Node, ULONG OffsetInVad)
 	Old_Vad.m_Size = OffsetInVad;
 	NewVad.m_Start += OffsetInVad;
 	NewVad.m_Size -= OffsetInVad;
+	UpdateVADPath(Old_Vad.m_Start);
 
 	// Add the new split vad to the tree
 	VAD_NODE *InsertedVad;
@@ -343,6 +461,7 @@ static VAD_NODE *CarveVAD(ULONG Start, ULONG Size)
 		if (SplitVAD(Node, EndInVad) == nullptr) {
 			// Undo the split at the end that was done above
 			Vad.m_Size = OldSize;
+			UpdateVADPath(Vad.m_Start);
 			return nullptr;
 		}
 		SplitAtEnd = TRUE;
@@ -353,8 +472,10 @@ static VAD_NODE *CarveVAD(ULONG Start, ULONG Size)
 		if (Node == nullptr) {
 			if (SplitAtEnd) {
 				// Undo the split at the end that was done above and erase the newly added vad
+				ULONG VadStart = Vad.m_Start;
 				Vad.m_Size = OldSize;
-				EraseVADNode(Vad.m_Start + EndInVad);
+				EraseVADNode(VadStart + EndInVad);
+				UpdateVADPath(VadStart);
 			}
 
 			return nullptr;
@@ -380,6 +501,7 @@ static VAD_NODE *CarveVADRange(ULONG Start, ULONG Size)
 		if (BeginVad == nullptr) {
 			// Undo the split at the beginning that was done above
 			Vad.m_Size = OldSize;
+			UpdateVADPath(Vad.m_Start);
 			return nullptr;
 		}
 		SplitAtBeginning = TRUE;
@@ -391,8 +513,10 @@ static VAD_NODE *CarveVADRange(ULONG Start, ULONG Size)
 		if (EndVad == nullptr) {
 			if (SplitAtBeginning) {
 				// Undo the split at the beginning that was done above and erase the newly added vad
+				ULONG VadStart = Vad.m_Start;
 				Vad.m_Size = OldSize;
-				EraseVADNode(Vad.m_Start + StartInVad);
+				EraseVADNode(VadStart + StartInVad);
+				UpdateVADPath(VadStart);
 			}
 
 			return nullptr;
@@ -409,6 +533,7 @@ static VAD_NODE *MergeAdjacentVAD(VAD_NODE *Node)
 		Node->m_Vad.m_Size += NextNode->m_Vad.m_Size;
 		ULONG Start = Node->m_Start;
 		EraseVADNode(NextNode->m_Start);
+		UpdateVADPath(Start);
 		Node = GetVADNode(Start);
 	}
 
@@ -418,6 +543,7 @@ static VAD_NODE *MergeAdjacentVAD(VAD_NODE *Node)
 			PrevNode->m_Vad.m_Size += Node->m_Vad.m_Size;
 			ULONG PrevStart = PrevNode->m_Start;
 			EraseVADNode(Node->m_Start);
+			UpdateVADPath(PrevStart);
 			Node = GetVADNode(PrevStart);
 		}
 	}
@@ -430,6 +556,7 @@ static VAD_NODE *UnmapVAD(VAD_NODE *Node)
 	VAD &Vad = Node->m_Vad;
 	Vad.m_Type = Free;
 	Vad.m_Protect = PAGE_NOACCESS;
+	UpdateVADPath(Vad.m_Start);
 
 	return MergeAdjacentVAD(Node);
 }
@@ -498,60 +625,94 @@ VAD_NODE *CheckConflictingVAD(ULONG Addr, ULONG Size, BOOLEAN *Overflow)
 	return nullptr; // no conflict
 }
 
-BOOLEAN ConstructVAD(ULONG Start, ULONG Size, ULONG Protect)
+static ULONG FindFreeVAD(VAD_NODE *Node, ULONG Size, ULONG HighestAddress)
 {
-	VAD_NODE *CarvedNode = CarveVAD(Start, Size);
-	if (CarvedNode == nullptr) {
-		return FALSE;
+	if ((Node == nullptr) || (Node->m_MaxFree < Size)) {
+		return 0;
 	}
 
-	VAD &Vad = CarvedNode->m_Vad;
-	Vad.m_Type = Reserved;
-	Vad.m_Protect = Protect;
+	ULONG Addr = FindFreeVAD(Node->m_Left, Size, HighestAddress);
+	if (Addr) {
+		return Addr;
+	}
 
-	// Depending on the splitting done by CarveVMA and the type of the adjacent VADs, there are no guarantees that the next
-	// or previous VADs are free. We are just going to iterate forward and backward until we find one.
+	if (Node->m_Start > HighestAddress) {
+		// This vad and all the ones to its right are above the limit
+		return 0;
+	}
 
-	VAD_NODE *Node = GetNextVAD(CarvedNode);
-	VAD_NODE *NodeBegin = GetVADNode(LOWEST_USER_ADDRESS);
-	VAD_NODE *NodeEnd = nullptr;
+	if (CalcFreeSize(Node->m_Vad, HighestAddress) >= Size) {
+		return ROUND_UP(Node->m_Start, X64K);
+	}
 
-	while (Node != NodeEnd) {
-		if (Node->m_Vad.m_Type == Free) {
-			MiLastFree = Node;
-			return TRUE;
-		}
+	return FindFreeVAD(Node->m_Right, Size, HighestAddress);
+}
 
-		Node = GetNextVAD(Node);
+static ULONG FindFreeVADTopDown(VAD_NODE *Node, ULONG Size, ULONG HighestAddress)
+{
+	if ((Node == nullptr) || (Node->m_MaxFree < Size)) {
+		return 0;
 	}
 
-	if (CarvedNode == NodeBegin) {
-		MiLastFree = nullptr;
-		return TRUE;
-	}
+	if (Node->m_Start <= HighestAddress) {
+		ULONG Addr = FindFreeVADTopDown(Node->m_Right, Size, HighestAddress);
+		if (Addr) {
+			return Addr;
+		}
 
-	Node = GetPrevVAD(CarvedNode);
+		if (CalcFreeSize(Node->m_Vad, HighestAddress) >= Size) {
+			ULONG VadEnd = Node->m_Start + Node->m_Vad.m_Size;
+			if (VadEnd > (HighestAddress + 1)) {
+				VadEnd = HighestAddress + 1;
+			}
 
-	while (true) {
-		if (Node->m_Vad.m_Type == Free) {
-			MiLastFree = Node;
-			return TRUE;
+			return ROUND_DOWN(VadEnd - Size, X64K);
 		}
+	}
 
-		if (Node == NodeBegin) {
-			break;
-		}
+	return FindFreeVADTopDown(Node->m_Left, Size, HighestAddress);
+}
+
+ULONG FindFreeVAD(ULONG Size, ULONG HighestAddress, BOOLEAN TopDown)
+{
+	// The subtrees whose largest free block is too small are skipped entirely, so only the vads that can actually hold the
+	// allocation are visited. Returns the lowest (or highest with TopDown) 64 KiB aligned address that fits below HighestAddress,
+	// or zero if there is none
+
+	if (TopDown) {
+		return FindFreeVADTopDown(MiVadRoot, Size, HighestAddress);
+	}
+
+	return FindFreeVAD(MiVadRoot, Size, HighestAddress);
+}
+
+BOOLEAN ConstructVAD(ULONG Start, ULONG Size, ULONG Protect)
+{
+	// Make sure that the splits done by CarveVAD will succeed before touching the tree
+	if (ReserveVADNodes() == FALSE) {
+		return FALSE;
+	}
 
-		Node = GetPrevVAD(Node);
+	VAD_NODE *CarvedNode = CarveVAD(Start, Size);
+	if (CarvedNode == nullptr) {
+		return FALSE;
 	}
 
-	MiLastFree = nullptr;
+	VAD &Vad = CarvedNode->m_Vad;
+	Vad.m_Type = Reserved;
+	Vad.m_Protect = Protect;
+	UpdateVADPath(Vad.m_Start);
 
 	return TRUE;
 }
 
 BOOLEAN DestructVAD(ULONG Addr, ULONG Size)
 {
+	// Make sure that the splits done by CarveVADRange will succeed before touching the tree
+	if (ReserveVADNodes() == FALSE) {
+		return FALSE;
+	}
+
 	VAD_NODE *CarvedNode = CarveVADRange(Addr, Size);
 	if (CarvedNode == nullptr) {
 		return FALSE;
@@ -562,46 +723,5 @@ BOOLEAN DestructVAD(ULONG Addr, ULONG Size)
 		CarvedNode = GetNextVAD(UnmapVAD(CarvedNode));
 	}
 
-	// If we free an entire VAD, GetPrevVAD(CarvedNode) will be the freed VAD. If it is not, we'll do a standard search
-	VAD_NODE *NodeBegin = GetVADNode(LOWEST_USER_ADDRESS);
-	VAD_NODE *PrevNode = GetPrevVAD(CarvedNode);
-	if ((CarvedNode != NodeBegin) && (PrevNode->m_Vad.m_Type == Free)) {
-		MiLastFree = PrevNode;
-		return TRUE;
-	}
-	else {
-		VAD_NODE *Node = CarvedNode;
-		while (Node) {
-			if (Node->m_Vad.m_Type == Free) {
-				MiLastFree = Node;
-				return TRUE;
-			}
-
-			Node = GetNextVAD(Node);
-		}
-
-		if (CarvedNode == NodeBegin) {
-			MiLastFree = nullptr;
-			return TRUE;
-		}
-
-		Node = PrevNode;
-
-		while (true) {
-			if (Node->m_Vad.m_Type == Free) {
-				MiLastFree = Node;
-				return TRUE;
-			}
-
-			if (Node == NodeBegin) {
-				break;
-			}
-
-			Node = GetPrevVAD(Node);
-		}
-
-		MiLastFree = nullptr;
-
-		return TRUE;
-	}
+	return TRUE;
 }
@@ -27,6 +27,8 @@ struct VAD_NODE {
 	ULONG m_Start;
 	VAD m_Vad;
 	int m_Height;
+	// Largest 64 KiB aligned free block found in the subtree rooted at this node
+	ULONG m_MaxFree;
 	VAD_NODE *m_Left, *m_Right;
 	VOID Init(ULONG Start, ULONG Size, VAD_TYPE Type, ULONG Protect);
 	int Compare(ULONG Start);
@@ -38,8 +40,10 @@ VAD_NODE *GetNextVAD(VAD_NODE *Node);
 VAD_NODE *GetPrevVAD(VAD_NODE *Node);
 VAD_NODE *GetVADNode(ULONG Start);
 VAD_NODE *CheckConflictingVAD(ULONG Addr, ULONG Size, BOOLEAN *Overflow);
+ULONG FindFreeVAD(ULONG Size, ULONG HighestAddress, BOOLEAN TopDown);
 BOOLEAN ConstructVAD(ULONG Start, ULONG Size, ULONG Protect);
 BOOLEAN DestructVAD(ULONG Addr, ULONG Size);
 
 inline VAD_NODE *MiVadRoot = nullptr;
+// No longer used by the allocator, only kept because MmGlobalData exposes it
 inline VAD_NODE *MiLastFree = nullptr;
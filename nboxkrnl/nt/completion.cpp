@@ -0,0 +1,111 @@
+/*
+ * ergo720                Copyright (c) 2023
+ */
+
+#include "nt.hpp"
+#include "ex.hpp"
+
+
+EXPORTNUM(191) NTSTATUS XBOXAPI NtCreateIoCompletion
+(
+	PHANDLE IoCompletionHandle,
+	ACCESS_MASK DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	ULONG Count
+)
+{
+	PVOID IoCompletionObject;
+	NTSTATUS Status = ObCreateObject(&IoCompletionObjectType, ObjectAttributes, sizeof(KQUEUE), &IoCompletionObject);
+
+	if (NT_SUCCESS(Status)) {
+		KeInitializeQueue((PKQUEUE)IoCompletionObject, Count);
+		Status = ObInsertObject(IoCompletionObject, ObjectAttributes, 0, IoCompletionHandle);
+	}
+
+	return Status;
+}
+
+EXPORTNUM(212) NTSTATUS XBOXAPI NtQueryIoCompletion
+(
+	HANDLE IoCompletionHandle,
+	PIO_COMPLETION_BASIC_INFORMATION IoCompletionInformation
+)
+{
+	PVOID IoCompletionObject;
+	NTSTATUS Status = ObReferenceObjectByHandle(IoCompletionHandle, &IoCompletionObjectType, &IoCompletionObject);
+
+	if (NT_SUCCESS(Status)) {
+		// The signal state of a queue is the number of entries queued to it
+		IoCompletionInformation->Depth = ((PKQUEUE)IoCompletionObject)->Header.SignalState;
+		ObfDereferenceObject(IoCompletionObject);
+	}
+
+	return Status;
+}
+
+EXPORTNUM(223) NTSTATUS XBOXAPI NtRemoveIoCompletion
+(
+	HANDLE IoCompletionHandle,
+	PVOID *KeyContext,
+	PVOID *ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PLARGE_INTEGER Timeout
+)
+{
+	PVOID IoCompletionObject;
+	NTSTATUS Status = ObReferenceObjectByHandle(IoCompletionHandle, &IoCompletionObjectType, &IoCompletionObject);
+
+	if (NT_SUCCESS(Status)) {
+		// KeRemoveQueue returns either an entry or a wait status, which are always smaller than any valid address
+		PLIST_ENTRY Entry = KeRemoveQueue((PKQUEUE)IoCompletionObject, KernelMode, Timeout);
+
+		if (Entry == (PLIST_ENTRY)STATUS_TIMEOUT) {
+			Status = STATUS_TIMEOUT;
+		}
+		else if (Entry == (PLIST_ENTRY)STATUS_USER_APC) {
+			Status = STATUS_USER_APC;
+		}
+		else {
+			PIO_MINI_COMPLETION_PACKET MiniPacket = CONTAINING_RECORD(Entry, IO_MINI_COMPLETION_PACKET, ListEntry);
+			if (MiniPacket->PacketType == IopCompletionPacketIrp) {
+				PIRP Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+				*KeyContext = Irp->Tail.CompletionKey;
+				*ApcContext = Irp->Overlay.AsynchronousParameters.UserApcContext;
+				IoStatusBlock->Status = Irp->IoStatus.Status;
+				IoStatusBlock->Information = Irp->IoStatus.Information;
+				IoFreeIrp(Irp);
+			}
+			else {
+				*KeyContext = MiniPacket->KeyContext;
+				*ApcContext = MiniPacket->ApcContext;
+				IoStatusBlock->Status = MiniPacket->IoStatus;
+				IoStatusBlock->Information = MiniPacket->IoStatusInformation;
+				ExFreePool(MiniPacket);
+			}
+		}
+
+		ObfDereferenceObject(IoCompletionObject);
+	}
+
+	return Status;
+}
+
+EXPORTNUM(227) NTSTATUS XBOXAPI NtSetIoCompletion
+(
+	HANDLE IoCompletionHandle,
+	PVOID KeyContext,
+	PVOID ApcContext,
+	NTSTATUS IoStatus,
+	ULONG_PTR IoStatusInformation
+)
+{
+	PVOID IoCompletionObject;
+	NTSTATUS Status = ObReferenceObjectByHandle(IoCompletionHandle, &IoCompletionObjectType, &IoCompletionObject);
+
+	if (NT_SUCCESS(Status)) {
+		Status = IoSetIoCompletion(IoCompletionObject, KeyContext, ApcContext, IoStatus, IoStatusInformation);
+		ObfDereferenceObject(IoCompletionObject);
+	}
+
+	return Status;
+}
@@ -5,6 +5,7 @@
 #include "nt.hpp"
 #include "ex.hpp"
 #include "rtl.hpp"
+#include "mm.hpp"
 
 
 EXPORTNUM(190) NTSTATUS XBOXAPI NtCreateFile
@@ -178,9 +179,7 @@ EXPORTNUM(218) NTSTATUS XBOXAPI NtQueryVolumeInformationFile
 	Irp->Tail.Overlay.OriginalFileObject = FileObject;
 	Irp->Tail.Overlay.Thread = (PETHREAD)KeGetCurrentThread();
 	Irp->UserBuffer = FileInformation;
-	if (IsSynchronousIo) {
-		Irp->UserIosb = IoStatusBlock;
-	}
+	Irp->UserIosb = IoStatusBlock;
 	Irp->Flags |= (IRP_SYNCHRONOUS_API | IRP_DEFER_IO_COMPLETION);
 
 	PIO_STACK_LOCATION IrpStackPointer = IoGetNextIrpStackLocation(Irp);
@@ -194,18 +193,11 @@ EXPORTNUM(218) NTSTATUS XBOXAPI NtQueryVolumeInformationFile
 	return IopSynchronousService(DeviceObject, Irp, FileObject, TRUE, IsSynchronousIo);
 }
 
-EXPORTNUM(219) DLLEXPORT NTSTATUS XBOXAPI NtReadFile
-(
-	HANDLE FileHandle,
-	HANDLE Event,
-	PIO_APC_ROUTINE ApcRoutine,
-	PVOID ApcContext,
-	PIO_STATUS_BLOCK IoStatusBlock,
-	PVOID Buffer,
-	ULONG Length,
-	PLARGE_INTEGER ByteOffset
-)
+static NTSTATUS IopReadFile(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine, PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, PVOID Buffer,
+	PFILE_SEGMENT_ELEMENT SegmentArray, ULONG Length, PLARGE_INTEGER ByteOffset, ULONG IrpFlags)
 {
+	// Shared by NtReadFile and NtReadFileScatter. IrpFlags is either zero or IRP_SCATTER_GATHER_OPERATION, in which case SegmentArray is used instead of Buffer
+
 	PFILE_OBJECT FileObject;
 	NTSTATUS Status = ObReferenceObjectByHandle(FileHandle, &IoFileObjectType, (PVOID *)&FileObject);
 	if (!NT_SUCCESS(Status)) {
@@ -217,9 +209,16 @@ EXPORTNUM(219) DLLEXPORT NTSTATUS XBOXAPI NtReadFile
 		return STATUS_ACCESS_DENIED;
 	}
 
+	// Scatter/gather requests transfer whole sectors straight to the user pages, so they cannot be buffered
+	if ((IrpFlags & IRP_SCATTER_GATHER_OPERATION) &&
+		(!(FileObject->Flags & FO_NO_INTERMEDIATE_BUFFERING) || !(FileObject->DeviceObject->Flags & DO_SCATTER_GATHER_IO))) {
+		ObfDereferenceObject(FileObject);
+		return STATUS_INVALID_PARAMETER;
+	}
+
 	PKEVENT UserEvent = nullptr;
 	if (Event) {
-		NTSTATUS Status = ObReferenceObjectByHandle(Event, &ExEventObjectType, (PVOID *)&UserEvent);
+		Status = ObReferenceObjectByHandle(Event, &ExEventObjectType, (PVOID *)&UserEvent);
 		if (!NT_SUCCESS(Status)) {
 			ObfDereferenceObject(FileObject);
 			return Status;
@@ -234,8 +233,8 @@ EXPORTNUM(219) DLLEXPORT NTSTATUS XBOXAPI NtReadFile
 	else {
 		if (!ByteOffset || (ByteOffset->QuadPart < 0)) {
 			ObfDereferenceObject(FileObject);
-			if (Event) {
-				ObfDereferenceObject(Event);
+			if (UserEvent) {
+				ObfDereferenceObject(UserEvent);
 			}
 			return STATUS_INVALID_PARAMETER;
 		}
@@ -249,7 +248,6 @@ EXPORTNUM(219) DLLEXPORT NTSTATUS XBOXAPI NtReadFile
 	}
 	else {
 		IsSynchronousIo = FALSE;
-		RIP_API_MSG("Asynchronous IO is not supported");
 	}
 
 	PDEVICE_OBJECT DeviceObject = FileObject->DeviceObject;
@@ -262,11 +260,10 @@ EXPORTNUM(219) DLLEXPORT NTSTATUS XBOXAPI NtReadFile
 	Irp->Overlay.AsynchronousParameters.UserApcRoutine = ApcRoutine;
 	Irp->Overlay.AsynchronousParameters.UserApcContext = ApcContext;
 	Irp->UserBuffer = Buffer;
+	Irp->SegmentArray = SegmentArray;
 	Irp->UserEvent = UserEvent;
-	if (IsSynchronousIo) {
-		Irp->UserIosb = IoStatusBlock;
-	}
-	Irp->Flags |= (IRP_READ_OPERATION | IRP_DEFER_IO_COMPLETION);
+	Irp->UserIosb = IoStatusBlock;
+	Irp->Flags |= (IRP_READ_OPERATION | IRP_DEFER_IO_COMPLETION | IrpFlags);
 
 	PIO_STACK_LOCATION IrpStackPointer = IoGetNextIrpStackLocation(Irp);
 	IrpStackPointer->MajorFunction = IRP_MJ_READ;
@@ -279,28 +276,122 @@ EXPORTNUM(219) DLLEXPORT NTSTATUS XBOXAPI NtReadFile
 	return IopSynchronousService(DeviceObject, Irp, FileObject, TRUE, IsSynchronousIo);
 }
 
-EXPORTNUM(232) DLLEXPORT VOID XBOXAPI NtUserIoApcDispatcher
+EXPORTNUM(219) DLLEXPORT NTSTATUS XBOXAPI NtReadFile
 (
+	HANDLE FileHandle,
+	HANDLE Event,
+	PIO_APC_ROUTINE ApcRoutine,
 	PVOID ApcContext,
 	PIO_STATUS_BLOCK IoStatusBlock,
-	ULONG Reserved
+	PVOID Buffer,
+	ULONG Length,
+	PLARGE_INTEGER ByteOffset
 )
 {
-	RIP_UNIMPLEMENTED();
+	return IopReadFile(FileHandle, Event, ApcRoutine, ApcContext, IoStatusBlock, Buffer, nullptr, Length, ByteOffset, 0);
 }
 
-EXPORTNUM(236) NTSTATUS XBOXAPI NtWriteFile
+EXPORTNUM(220) DLLEXPORT NTSTATUS XBOXAPI NtReadFileScatter
 (
 	HANDLE FileHandle,
 	HANDLE Event,
 	PIO_APC_ROUTINE ApcRoutine,
 	PVOID ApcContext,
 	PIO_STATUS_BLOCK IoStatusBlock,
-	PVOID Buffer,
+	PFILE_SEGMENT_ELEMENT SegmentArray,
 	ULONG Length,
 	PLARGE_INTEGER ByteOffset
 )
 {
+	// The host transfers a whole page for each segment, so don't allow a partial last segment
+	if (Length & PAGE_MASK) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	return IopReadFile(FileHandle, Event, ApcRoutine, ApcContext, IoStatusBlock, nullptr, SegmentArray, Length, ByteOffset, IRP_SCATTER_GATHER_OPERATION);
+}
+
+EXPORTNUM(226) NTSTATUS XBOXAPI NtSetInformationFile
+(
+	HANDLE FileHandle,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID FileInformation,
+	ULONG Length,
+	FILE_INFORMATION_CLASS FileInformationClass
+)
+{
+	// Only the association of a file with a completion port is supported for now. It's handled here because it only concerns the file object, and
+	// the file system drivers don't implement IRP_MJ_SET_INFORMATION yet
+	if (FileInformationClass != FileCompletionInformation) {
+		RIP_API_MSG("Only FileCompletionInformation is supported");
+		return STATUS_INVALID_INFO_CLASS;
+	}
+
+	if (Length < sizeof(FILE_COMPLETION_INFORMATION)) {
+		return STATUS_INFO_LENGTH_MISMATCH;
+	}
+
+	PFILE_OBJECT FileObject;
+	NTSTATUS Status = ObReferenceObjectByHandle(FileHandle, &IoFileObjectType, (PVOID *)&FileObject);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	PVOID IoCompletionObject;
+	Status = ObReferenceObjectByHandle(PFILE_COMPLETION_INFORMATION(FileInformation)->Port, &IoCompletionObjectType, &IoCompletionObject);
+	if (NT_SUCCESS(Status)) {
+		PIO_COMPLETION_CONTEXT CompletionContext = (PIO_COMPLETION_CONTEXT)ExAllocatePoolWithTag(sizeof(IO_COMPLETION_CONTEXT), 'cCoI');
+		if (CompletionContext) {
+			CompletionContext->Port = IoCompletionObject;
+			CompletionContext->Key = PFILE_COMPLETION_INFORMATION(FileInformation)->Key;
+
+			// A file can only be associated with a single port. The reference to the port is released by IopCloseFile
+			if (InterlockedCompareExchange((PLONG)&FileObject->CompletionContext, (LONG)CompletionContext, 0) == 0) {
+				IoStatusBlock->Status = STATUS_SUCCESS;
+				IoStatusBlock->Information = 0;
+			}
+			else {
+				ExFreePool(CompletionContext);
+				ObfDereferenceObject(IoCompletionObject);
+				Status = STATUS_INVALID_PARAMETER;
+			}
+		}
+		else {
+			ObfDereferenceObject(IoCompletionObject);
+			Status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	ObfDereferenceObject(FileObject);
+
+	return Status;
+}
+
+EXPORTNUM(232) DLLEXPORT VOID XBOXAPI NtUserIoApcDispatcher
+(
+	PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	ULONG Reserved
+)
+{
+	// The ApcContext is the completion routine that the title passed for the overlapped request, so convert the io status block to the arguments it expects
+	ULONG ErrorCode = 0;
+	ULONG NumberOfBytesTransferred = 0;
+	if (NT_SUCCESS(IoStatusBlock->Status)) {
+		NumberOfBytesTransferred = (ULONG)IoStatusBlock->Information;
+	}
+	else {
+		ErrorCode = RtlNtStatusToDosError(IoStatusBlock->Status);
+	}
+
+	((POVERLAPPED_COMPLETION_ROUTINE)ApcContext)(ErrorCode, NumberOfBytesTransferred, IoStatusBlock);
+}
+
+static NTSTATUS IopWriteFile(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine, PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, PVOID Buffer,
+	PFILE_SEGMENT_ELEMENT SegmentArray, ULONG Length, PLARGE_INTEGER ByteOffset, ULONG IrpFlags)
+{
+	// Shared by NtWriteFile and NtWriteFileGather. IrpFlags is either zero or IRP_SCATTER_GATHER_OPERATION, in which case SegmentArray is used instead of Buffer
+
 	PFILE_OBJECT FileObject;
 	NTSTATUS Status = ObReferenceObjectByHandle(FileHandle, &IoFileObjectType, (PVOID *)&FileObject);
 	if (!NT_SUCCESS(Status)) {
@@ -312,9 +403,16 @@ EXPORTNUM(236) NTSTATUS XBOXAPI NtWriteFile
 		return STATUS_ACCESS_DENIED;
 	}
 
+	// Scatter/gather requests transfer whole sectors straight from the user pages, so they cannot be buffered
+	if ((IrpFlags & IRP_SCATTER_GATHER_OPERATION) &&
+		(!(FileObject->Flags & FO_NO_INTERMEDIATE_BUFFERING) || !(FileObject->DeviceObject->Flags & DO_SCATTER_GATHER_IO))) {
+		ObfDereferenceObject(FileObject);
+		return STATUS_INVALID_PARAMETER;
+	}
+
 	PKEVENT UserEvent = nullptr;
 	if (Event) {
-		NTSTATUS Status = ObReferenceObjectByHandle(Event, &ExEventObjectType, (PVOID *)&UserEvent);
+		Status = ObReferenceObjectByHandle(Event, &ExEventObjectType, (PVOID *)&UserEvent);
 		if (!NT_SUCCESS(Status)) {
 			ObfDereferenceObject(FileObject);
 			return Status;
@@ -332,8 +430,8 @@ EXPORTNUM(236) NTSTATUS XBOXAPI NtWriteFile
 	else {
 		if (!ByteOffset || (ByteOffset->QuadPart < 0)) {
 			ObfDereferenceObject(FileObject);
-			if (Event) {
-				ObfDereferenceObject(Event);
+			if (UserEvent) {
+				ObfDereferenceObject(UserEvent);
 			}
 			return STATUS_INVALID_PARAMETER;
 		}
@@ -347,7 +445,6 @@ EXPORTNUM(236) NTSTATUS XBOXAPI NtWriteFile
 	}
 	else {
 		IsSynchronousIo = FALSE;
-		RIP_API_MSG("Asynchronous IO is not supported");
 	}
 
 	PDEVICE_OBJECT DeviceObject = FileObject->DeviceObject;
@@ -360,11 +457,10 @@ EXPORTNUM(236) NTSTATUS XBOXAPI NtWriteFile
 	Irp->Overlay.AsynchronousParameters.UserApcRoutine = ApcRoutine;
 	Irp->Overlay.AsynchronousParameters.UserApcContext = ApcContext;
 	Irp->UserBuffer = Buffer;
+	Irp->SegmentArray = SegmentArray;
 	Irp->UserEvent = UserEvent;
-	if (IsSynchronousIo) {
-		Irp->UserIosb = IoStatusBlock;
-	}
-	Irp->Flags |= (IRP_WRITE_OPERATION | IRP_DEFER_IO_COMPLETION);
+	Irp->UserIosb = IoStatusBlock;
+	Irp->Flags |= (IRP_WRITE_OPERATION | IRP_DEFER_IO_COMPLETION | IrpFlags);
 
 	PIO_STACK_LOCATION IrpStackPointer = IoGetNextIrpStackLocation(Irp);
 	IrpStackPointer->MajorFunction = IRP_MJ_WRITE;
@@ -376,3 +472,38 @@ EXPORTNUM(236) NTSTATUS XBOXAPI NtWriteFile
 
 	return IopSynchronousService(DeviceObject, Irp, FileObject, TRUE, IsSynchronousIo);
 }
+
+EXPORTNUM(236) NTSTATUS XBOXAPI NtWriteFile
+(
+	HANDLE FileHandle,
+	HANDLE Event,
+	PIO_APC_ROUTINE ApcRoutine,
+	PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID Buffer,
+	ULONG Length,
+	PLARGE_INTEGER ByteOffset
+)
+{
+	return IopWriteFile(FileHandle, Event, ApcRoutine, ApcContext, IoStatusBlock, Buffer, nullptr, Length, ByteOffset, 0);
+}
+
+EXPORTNUM(237) NTSTATUS XBOXAPI NtWriteFileGather
+(
+	HANDLE FileHandle,
+	HANDLE Event,
+	PIO_APC_ROUTINE ApcRoutine,
+	PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PFILE_SEGMENT_ELEMENT SegmentArray,
+	ULONG Length,
+	PLARGE_INTEGER ByteOffset
+)
+{
+	// The host transfers a whole page for each segment, so don't allow a partial last segment
+	if (Length & PAGE_MASK) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	return IopWriteFile(FileHandle, Event, ApcRoutine, ApcContext, IoStatusBlock, nullptr, SegmentArray, Length, ByteOffset, IRP_SCATTER_GATHER_OPERATION);
+}
@@ -5,73 +5,11 @@
 #include "nt.hpp"
 #include "..\ntstatus.hpp"
 #include "mi.hpp"
+#include "fsc.hpp"
 #include "vad_tree.hpp"
 #include <assert.h>
 
 
-static ULONG MapMemoryBlock(ULONG Size, ULONG HighestAddress)
-{
-	VAD_NODE *Node = MiLastFree;
-	VAD_NODE *EndNode = GetNextVAD(GetVADNode(HighestAddress));
-
-	while (Node != EndNode) {
-		if (Node->m_Vad.m_Type != Free) { // already reserved
-			Node = GetNextVAD(Node);
-			continue;
-		}
-
-		ULONG Addr = Node->m_Start;
-		if (!CHECK_ALIGNMENT(Addr, X64K)) {
-			// Addr is not aligned with the xbox granularity, jump to the next granularity boundary
-			Addr = ROUND_UP(Addr, X64K);
-		}
-
-		// Make sure that the end address of this allocation won't exceed HighestAddress
-		ULONG VadEnd = Node->m_Start + Node->m_Vad.m_Size;
-		if (VadEnd > (HighestAddress + 1)) {
-			VadEnd = HighestAddress + 1;
-		}
-
-		if ((Addr + Size - 1) < VadEnd) {
-			return Addr;
-		}
-
-		Node = GetNextVAD(Node);
-	}
-
-	// If we are here, it means we reached the end of the user region. In desperation, we also try to map it from
-	// MiLastFree and going backwards, since there could be holes created by deallocation operations...
-
-	VAD_NODE *BeginNode = GetVADNode(LOWEST_USER_ADDRESS);
-	if (MiLastFree == BeginNode) {
-		return 0;
-	}
-
-	Node = GetPrevVAD(MiLastFree);
-	while (true) {
-		if (Node->m_Vad.m_Type == Free) {
-			ULONG Addr = Node->m_Start;
-			if (!CHECK_ALIGNMENT(Addr, X64K)) {
-				// Addr is not aligned with the xbox granularity, jump to the next granularity boundary
-				Addr = ROUND_UP(Addr, X64K);
-			}
-
-			ULONG VadEnd = Node->m_Start + Node->m_Vad.m_Size;
-			if ((Addr + Size - 1) < VadEnd) {
-				return Addr;
-			}
-		}
-
-		if (Node == BeginNode) {
-			break;
-		}
-
-		Node = GetPrevVAD(Node);
-	}
-
-	return 0;
-}
-
 EXPORTNUM(184) NTSTATUS XBOXAPI NtAllocateVirtualMemory
 (
 	PVOID *BaseAddress,
@@ -145,11 +83,7 @@ EXPORTNUM(184) NTSTATUS XBOXAPI NtAllocateVirtualMemory
 				MaxAllowedAddress = HIGHEST_USER_ADDRESS;
 			}
 
-			if (AllocationType & MEM_TOP_DOWN) {
-				MiLastFree = GetVADNode(MaxAllowedAddress);
-			}
-
-			AlignedCapturedBase = MapMemoryBlock(AlignedCapturedSize, MaxAllowedAddress);
+			AlignedCapturedBase = FindFreeVAD(AlignedCapturedSize, MaxAllowedAddress, (AllocationType & MEM_TOP_DOWN) ? TRUE : FALSE);
 			if (!AlignedCapturedBase) {
 				VadUnlock();
 				return STATUS_NO_MEMORY;
@@ -229,7 +163,7 @@ EXPORTNUM(184) NTSTATUS XBOXAPI NtAllocateVirtualMemory
 	PMMPTE EndingPte = GetPteAddress(AlignedCapturedBase + AlignedCapturedSize - 1);
 	PMMPTE StartingPte = PointerPte;
 	BOOLEAN UpdatePteProtections = FALSE;
-	PFN_COUNT PteNumber = 0;
+	PFN_COUNT PteNumber = 0, PtNumber = 0;
 
 	while (PointerPte <= EndingPte) {
 		if ((PointerPte == StartingPte) || IsPteOnPdeBoundary(PointerPte)) {
@@ -237,6 +171,7 @@ EXPORTNUM(184) NTSTATUS XBOXAPI NtAllocateVirtualMemory
 			if ((PointerPde->Hw & PTE_VALID_MASK) == 0) {
 				// PDE is invalid, so we need to commit an extra page for the page table
 				++PteNumber;
+				++PtNumber;
 				// Also count the pages to commit for the PDE
 				PMMPTE NextPointerPte = (PMMPTE)GetVAddrMappedByPte(PointerPde + 1);
 				if (NextPointerPte > EndingPte) {
@@ -254,13 +189,28 @@ EXPORTNUM(184) NTSTATUS XBOXAPI NtAllocateVirtualMemory
 		if (PointerPte->Hw == 0) {
 			++PteNumber;
 		}
-		else if ((PointerPte->Hw & PTE_VALID_PROTECTION_MASK) != TempPte.Hw) {
-			UpdatePteProtections = TRUE;
+		else {
+			// Demand zero ptes are not valid yet, but they will be with the protection stored in them
+			ULONG PteProtection = PointerPte->Hw & PTE_VALID_PROTECTION_MASK;
+			if (PointerPte->Hw & PTE_DEMAND_ZERO_MASK) {
+				PteProtection |= PTE_VALID_MASK;
+			}
+			if (PteProtection != TempPte.Hw) {
+				UpdatePteProtections = TRUE;
+			}
 		}
 
 		++PointerPte;
 	}
 
+	if (PteNumber > MiRetailRegion.PagesAvailable) {
+		// Take back the pages of the cached kernel stacks and of the file system cache before failing
+		MiReleaseKernelStackCache();
+		if (PteNumber > MiRetailRegion.PagesAvailable) {
+			FscTrimCache(PteNumber - MiRetailRegion.PagesAvailable);
+		}
+	}
+
 	if (PteNumber > MiRetailRegion.PagesAvailable) {
 		if (MiAllowNonDebuggerOnTop64MiB) {
 			if (PteNumber <= MiDevkitRegion.PagesAvailable) {
@@ -281,9 +231,24 @@ EXPORTNUM(184) NTSTATUS XBOXAPI NtAllocateVirtualMemory
 	}
 	EnoughPages:
 
-	PFN_COUNT(*PfnAllocationRoutine)() = MiAllowNonDebuggerOnTop64MiB ? MiRemoveAnyPageFromFreeList : MiRemoveRetailPageFromFreeList;
-	VOID(*PageAllocationRoutine)(PFN_NUMBER, PageType, PMMPTE) = AllocationType & MEM_NOZERO ?
-		(VOID(*)(PFN_NUMBER, PageType, PMMPTE))MiRemovePageFromFreeList : MiRemoveAndZeroPageFromFreeList;
+	// Accessible pages that must be zeroed are only charged now, and their physical pages are allocated by MiPageFaultHandler when they are first touched. This
+	// requires that all the charged pages come from the retail region, because that's where the fault handler will take them from
+	BOOLEAN DemandZero = (TempPte.Hw & PTE_VALID_MASK) && ((AllocationType & MEM_NOZERO) == 0) && (PteNumber <= MiRetailRegion.PagesAvailable);
+	if (DemandZero) {
+		MiChargeDemandZeroPages(PteNumber - PtNumber);
+	}
+
+	// Unless MEM_NOZERO is specified, prefer the pages already zeroed by the idle thread
+	PFN_COUNT(*PfnAllocationRoutine)();
+	VOID(*PageAllocationRoutine)(PFN_NUMBER, PageType, PMMPTE);
+	if (AllocationType & MEM_NOZERO) {
+		PfnAllocationRoutine = MiAllowNonDebuggerOnTop64MiB ? MiRemoveAnyPageFromFreeList : MiRemoveRetailPageFromFreeList;
+		PageAllocationRoutine = MiRemovePageFromFreeList;
+	}
+	else {
+		PfnAllocationRoutine = MiAllowNonDebuggerOnTop64MiB ? MiRemoveAnyZeroedPageFromFreeList : MiRemoveRetailZeroedPageFromFreeList;
+		PageAllocationRoutine = MiRemoveAndZeroPageFromFreeList;
+	}
 	PageType BusyType = (Protect & (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE
 		| PAGE_EXECUTE_WRITECOPY)) ? Image : VirtualMemory;
 	PointerPte = StartingPte;
@@ -299,9 +264,18 @@ EXPORTNUM(184) NTSTATUS XBOXAPI NtAllocateVirtualMemory
 		}
 
 		if (PointerPte->Hw == 0) {
-			PFN_NUMBER PagePfn = PfnAllocationRoutine();
-			WritePte(PointerPte, ValidKernelPteBits | SetPfn(ConvertPfnToContiguous(PagePfn)));
-			PageAllocationRoutine(PagePfn, BusyType, PointerPte);
+			if (DemandZero) {
+				// The pfn of a demand zero pte holds the type of the page that will be allocated for it. MiResolveDemandZeroPte maps the page with ValidKernelPteBits,
+				// like the ptes committed below, so the stored protection is the one of those bits. This way, the protection of a commit doesn't depend on whether
+				// its pages were allocated eagerly or on demand
+				WritePte(PointerPte, (ValidKernelPteBits & PTE_VALID_PROTECTION_MASK & ~PTE_VALID_MASK) | PTE_DEMAND_ZERO_MASK | (BusyType << PAGE_SHIFT));
+				++GetPfnOfPt(PointerPte)->PtPageFrame.PtesUsed;
+			}
+			else {
+				PFN_NUMBER PagePfn = PfnAllocationRoutine();
+				WritePte(PointerPte, ValidKernelPteBits | SetPfn(ConvertPfnToContiguous(PagePfn)));
+				PageAllocationRoutine(PagePfn, BusyType, PointerPte);
+			}
 		}
 
 		++PointerPte;
@@ -45,6 +45,14 @@ EXPORTNUM(190) DLLEXPORT NTSTATUS XBOXAPI NtCreateFile
 	ULONG CreateOptions
 );
 
+EXPORTNUM(191) DLLEXPORT NTSTATUS XBOXAPI NtCreateIoCompletion
+(
+	PHANDLE IoCompletionHandle,
+	ACCESS_MASK DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	ULONG Count
+);
+
 EXPORTNUM(192) DLLEXPORT NTSTATUS XBOXAPI NtCreateMutant
 (
 	PHANDLE MutantHandle,
@@ -92,6 +100,12 @@ EXPORTNUM(211) DLLEXPORT NTSTATUS XBOXAPI NtQueryInformationFile
 	FILE_INFORMATION_CLASS FileInformationClass
 );
 
+EXPORTNUM(212) DLLEXPORT NTSTATUS XBOXAPI NtQueryIoCompletion
+(
+	HANDLE IoCompletionHandle,
+	PIO_COMPLETION_BASIC_INFORMATION IoCompletionInformation
+);
+
 EXPORTNUM(218) DLLEXPORT NTSTATUS XBOXAPI NtQueryVolumeInformationFile
 (
 	HANDLE FileHandle,
@@ -113,12 +127,51 @@ EXPORTNUM(219) DLLEXPORT NTSTATUS XBOXAPI NtReadFile
 	PLARGE_INTEGER ByteOffset
 );
 
+EXPORTNUM(220) DLLEXPORT NTSTATUS XBOXAPI NtReadFileScatter
+(
+	HANDLE FileHandle,
+	HANDLE Event,
+	PIO_APC_ROUTINE ApcRoutine,
+	PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PFILE_SEGMENT_ELEMENT SegmentArray,
+	ULONG Length,
+	PLARGE_INTEGER ByteOffset
+);
+
 EXPORTNUM(221) DLLEXPORT NTSTATUS XBOXAPI NtReleaseMutant
 (
 	HANDLE MutantHandle,
 	PLONG PreviousCount
 );
 
+EXPORTNUM(223) DLLEXPORT NTSTATUS XBOXAPI NtRemoveIoCompletion
+(
+	HANDLE IoCompletionHandle,
+	PVOID *KeyContext,
+	PVOID *ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PLARGE_INTEGER Timeout
+);
+
+EXPORTNUM(226) DLLEXPORT NTSTATUS XBOXAPI NtSetInformationFile
+(
+	HANDLE FileHandle,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID FileInformation,
+	ULONG Length,
+	FILE_INFORMATION_CLASS FileInformationClass
+);
+
+EXPORTNUM(227) DLLEXPORT NTSTATUS XBOXAPI NtSetIoCompletion
+(
+	HANDLE IoCompletionHandle,
+	PVOID KeyContext,
+	PVOID ApcContext,
+	NTSTATUS IoStatus,
+	ULONG_PTR IoStatusInformation
+);
+
 EXPORTNUM(232) DLLEXPORT VOID XBOXAPI NtUserIoApcDispatcher
 (
 	PVOID ApcContext,
@@ -153,6 +206,18 @@ EXPORTNUM(236) DLLEXPORT NTSTATUS XBOXAPI NtWriteFile
 	PLARGE_INTEGER ByteOffset
 );
 
+EXPORTNUM(237) DLLEXPORT NTSTATUS XBOXAPI NtWriteFileGather
+(
+	HANDLE FileHandle,
+	HANDLE Event,
+	PIO_APC_ROUTINE ApcRoutine,
+	PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PFILE_SEGMENT_ELEMENT SegmentArray,
+	ULONG Length,
+	PLARGE_INTEGER ByteOffset
+);
+
 #ifdef __cplusplus
 }
 #endif
@@ -169,7 +169,10 @@ EXPORTNUM(258) DLLEXPORT VOID XBOXAPI PsTerminateSystemThread
 
 	KeRaiseIrqlToDpcLevel();
 
-	// TODO: process thread's queue
+	if (kThread->Queue) {
+		RemoveEntryList(&kThread->QueueListEntry);
+		KiActivateWaiterQueue(kThread->Queue);
+	}
 
 	eThread->Tcb.Header.SignalState = 1;
 	// TODO: satisfy waiters that were waiting on this thread